@@ -0,0 +1,175 @@
+// Wake policy benchmark: producers send bursts with pauses in between so consumers keep going to sleep, and every
+// policy runs the same load. Reports throughput, enqueue-to-dequeue latency and how many consumers shared the work.
+// gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -pthread bench.c -o bench
+// usage: ./bench [seconds] [producers] [consumers] [burst] [work_kb]
+// Consumer i and producer i get affinity hint i % 2, standing in for two NUMA nodes; threads are not pinned.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "queue.c"
+
+#define LAT_BUCKETS 10000 // 1 us latency buckets, the last one collects everything slower
+
+size_t num_seconds = 2;
+size_t num_producers = 2;
+size_t num_consumers = 16;
+size_t burst = 8;
+size_t work_kb = 64; // private data each consumer walks per item, warm only if the consumer ran recently
+
+atomic_bool stop;
+
+typedef struct consumer
+{
+    int hint;
+    size_t items;
+    size_t* lat; // LAT_BUCKETS counters
+    unsigned char* work;
+} consumer;
+
+unsigned long long now_ns(void)
+{
+    // Wall clock in nanoseconds
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+int producer_main(void* arg)
+{
+    // Enqueue bursts of timestamped items, pausing between bursts
+    size_t p = (size_t) (uintptr_t) arg;
+    unsigned long long* item;
+    setAffinityHint((int) (p % 2));
+    while(!stop)
+    {
+        for(size_t i = 0; i < burst; i++)
+        {
+            item = malloc(sizeof(unsigned long long));
+            *item = now_ns();
+            enqueue(item);
+        }
+        thrd_sleep(&(struct timespec){0, 50000}, NULL);
+    }
+    return 0;
+}
+
+int consumer_main(void* arg)
+{
+    // Take items until a NULL pill, walking the private working set for each one
+    consumer* c = arg;
+    unsigned long long* item;
+    unsigned long long lat;
+    size_t sum = 0;
+    setAffinityHint(c->hint);
+    while((item = dequeue()) != NULL)
+    {
+        lat = (now_ns() - *item) / 1000;
+        c->lat[lat < LAT_BUCKETS ? lat : LAT_BUCKETS - 1]++;
+        c->items++;
+        free(item);
+        for(size_t i = 0; i < work_kb * 1024; i += 64)
+        {
+            sum += c->work[i]++;
+        }
+    }
+    return (int) (sum & 1);
+}
+
+void run(const char* name, wake_policy policy)
+{
+    // Run the load under one wake policy and print its numbers
+    thrd_t* producers = malloc(num_producers * sizeof(thrd_t));
+    thrd_t* consumers = malloc(num_consumers * sizeof(thrd_t));
+    consumer* cs = calloc(num_consumers, sizeof(consumer));
+    size_t* lat = calloc(LAT_BUCKETS, sizeof(size_t));
+    size_t total = 0;
+    size_t active = 0;
+    size_t seen = 0;
+    size_t p50 = 0;
+    size_t p99 = 0;
+    unsigned long long start;
+    unsigned long long elapsed;
+
+    initQueue();
+    setWakePolicy(defaultQueue(), policy);
+    stop = false;
+    for(size_t c = 0; c < num_consumers; c++)
+    {
+        cs[c].hint = (int) (c % 2);
+        cs[c].lat = calloc(LAT_BUCKETS, sizeof(size_t));
+        cs[c].work = calloc(work_kb * 1024 + 1, 1);
+        thrd_create(&consumers[c], consumer_main, &cs[c]);
+    }
+    start = now_ns();
+    for(size_t p = 0; p < num_producers; p++)
+    {
+        thrd_create(&producers[p], producer_main, (void*) (uintptr_t) p);
+    }
+    thrd_sleep(&(struct timespec){(time_t) num_seconds, 0}, NULL);
+    stop = true;
+    for(size_t p = 0; p < num_producers; p++)
+    {
+        thrd_join(producers[p], NULL);
+    }
+    elapsed = now_ns() - start;
+    for(size_t c = 0; c < num_consumers; c++)
+    {
+        enqueue(NULL);
+    }
+    for(size_t c = 0; c < num_consumers; c++)
+    {
+        thrd_join(consumers[c], NULL);
+        total += cs[c].items;
+        for(size_t b = 0; b < LAT_BUCKETS; b++)
+        {
+            lat[b] += cs[c].lat[b];
+        }
+    }
+    for(size_t c = 0; c < num_consumers; c++)
+    {
+        //a consumer counts as active if it did at least a tenth of its fair share
+        if(cs[c].items * num_consumers * 10 >= total)
+        {
+            active++;
+        }
+        free(cs[c].lat);
+        free(cs[c].work);
+    }
+    for(size_t b = 0; b < LAT_BUCKETS; b++)
+    {
+        seen += lat[b];
+        if(p50 == 0 && seen * 2 >= total)
+        {
+            p50 = b + 1;
+        }
+        if(p99 == 0 && seen * 100 >= total * 99)
+        {
+            p99 = b + 1;
+        }
+    }
+    destroyQueue();
+    printf("%-9s %10.0f items/s   p50 <%zu us   p99 <%zu us   %zu of %zu consumers active\n",
+           name, total / (elapsed / 1e9), p50, p99, active, num_consumers);
+    free(lat);
+    free(cs);
+    free(producers);
+    free(consumers);
+}
+
+int main(int argc, char** argv)
+{
+    size_t* params[] = {&num_seconds, &num_producers, &num_consumers, &burst, &work_kb};
+    for(int i = 1; i < argc && i <= 5; i++)
+    {
+        *params[i - 1] = strtoul(argv[i], NULL, 10);
+    }
+    run("fifo", WAKE_FIFO);
+    run("lifo", WAKE_LIFO);
+    run("affinity", WAKE_AFFINITY);
+    return 0;
+}
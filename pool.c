@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <threads.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include "queue.h"
+#include "pool.h"
+
+typedef struct pool_task
+{
+    int (*fn)(void*); // NULL is the poison pill that retires the worker taking it
+    void* arg;
+} pool_task;
+
+typedef struct pool_worker
+{
+    thrd_t thread;
+    pool_t* pool;
+    atomic_ullong busy_ns;
+    atomic_ullong idle_ns;
+    atomic_ullong tasks;
+    atomic_bool retired; // took a poison pill, only waiting to be joined
+    struct pool_worker* next;
+} pool_worker;
+
+struct pool
+{
+    queue_t* q; // tasks, idle workers sleep in its waiter list and get work in the order they went idle
+    mtx_t mtx; // guards workers, nthreads and the completion wait
+    cnd_t done_cnd;
+    pool_worker* workers;
+    size_t nthreads; // workers that did not take a poison pill yet
+    atomic_size_t caller_runs_depth; // 0 disables the caller-runs policy
+    atomic_size_t submitted;
+    atomic_size_t completed;
+};
+
+unsigned long long pool_now_ns(void)
+{
+    // Monotonic clock, so setting the wall clock cannot make the idle/busy deltas wrap
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+void pool_task_done(pool_t* p)
+{
+    // Count a finished task and wake pool_wait once everything submitted is done
+    mtx_lock(&p->mtx);
+    p->completed++;
+    if(p->completed == p->submitted)
+    {
+        cnd_broadcast(&p->done_cnd);
+    }
+    mtx_unlock(&p->mtx);
+}
+
+int pool_worker_main(void* arg)
+{
+    // Worker loop: block on the task queue, run the task, until a poison pill arrives
+    pool_worker* w = (pool_worker*) arg;
+    pool_t* p = w->pool;
+    pool_task* t;
+    unsigned long long start = pool_now_ns();
+    unsigned long long now;
+    while(true)
+    {
+        t = (pool_task*) dequeueFrom(p->q);
+        now = pool_now_ns();
+        w->idle_ns += now - start;
+        start = now;
+        if(t->fn == NULL)
+        {
+            free(t);
+            w->retired = true;
+            return 0;
+        }
+        t->fn(t->arg);
+        free(t);
+        now = pool_now_ns();
+        w->busy_ns += now - start;
+        w->tasks++;
+        start = now;
+        pool_task_done(p);
+    }
+}
+
+void pool_spawn(pool_t* p, size_t n)
+{
+    // Start n more workers, the caller holds the pool's mtx
+    pool_worker* w;
+    for(size_t i = 0; i < n; i++)
+    {
+        w = malloc(sizeof(pool_worker));
+        w->pool = p;
+        w->busy_ns = 0;
+        w->idle_ns = 0;
+        w->tasks = 0;
+        w->retired = false;
+        w->next = p->workers;
+        p->workers = w;
+        thrd_create(&w->thread, pool_worker_main, w);
+    }
+    p->nthreads += n;
+}
+
+void pool_retire(pool_t* p, size_t n)
+{
+    // Queue n poison pills; they sit behind the tasks already queued, so the backlog is drained first
+    pool_task* t;
+    for(size_t i = 0; i < n; i++)
+    {
+        t = malloc(sizeof(pool_task));
+        t->fn = NULL;
+        t->arg = NULL;
+        enqueueTo(p->q, t);
+    }
+    p->nthreads -= n;
+}
+
+void pool_reap(pool_t* p)
+{
+    // Join and free the workers that already took a poison pill, the caller holds the pool's mtx
+    pool_worker** pw = &p->workers;
+    pool_worker* w;
+    while(*pw != NULL)
+    {
+        w = *pw;
+        if(w->retired)
+        {
+            thrd_join(w->thread, NULL);
+            *pw = w->next;
+            free(w);
+        }
+        else
+        {
+            pw = &w->next;
+        }
+    }
+}
+
+pool_t* pool_create(size_t nthreads)
+{
+    // Create a pool running nthreads workers over a private queue
+    pool_t* p = malloc(sizeof(pool_t));
+    p->q = newQueue();
+    mtx_init(&p->mtx, mtx_plain);
+    cnd_init(&p->done_cnd);
+    p->workers = NULL;
+    p->nthreads = 0;
+    p->caller_runs_depth = 0;
+    p->submitted = 0;
+    p->completed = 0;
+    mtx_lock(&p->mtx);
+    pool_spawn(p, nthreads);
+    mtx_unlock(&p->mtx);
+    return p;
+}
+
+void pool_destroy(pool_t* p)
+{
+    // Let the workers finish every queued task, then stop and join them all
+    pool_worker* w;
+    mtx_lock(&p->mtx);
+    pool_retire(p, p->nthreads);
+    mtx_unlock(&p->mtx);
+    while(p->workers != NULL)
+    {
+        w = p->workers;
+        p->workers = w->next;
+        thrd_join(w->thread, NULL);
+        free(w);
+    }
+    freeQueue(p->q);
+    cnd_destroy(&p->done_cnd);
+    mtx_destroy(&p->mtx);
+    free(p);
+}
+
+void pool_submit(pool_t* p, int (*fn)(void*), void* arg)
+{
+    // Queue fn(arg) for the workers, or run it right here when the caller-runs policy applies
+    pool_task* t;
+    p->submitted++;
+    if(p->caller_runs_depth > 0 && queueSize(p->q) >= p->caller_runs_depth)
+    {
+        //the backlog is deep, throttle the producer by making it do the work
+        fn(arg);
+        pool_task_done(p);
+        return;
+    }
+    t = malloc(sizeof(pool_task));
+    t->fn = fn;
+    t->arg = arg;
+    enqueueTo(p->q, t);
+}
+
+void pool_wait(pool_t* p)
+{
+    // Block until every task submitted so far has completed
+    mtx_lock(&p->mtx);
+    while(p->completed != p->submitted)
+    {
+        cnd_wait(&p->done_cnd, &p->mtx);
+    }
+    mtx_unlock(&p->mtx);
+}
+
+void pool_resize(pool_t* p, size_t nthreads)
+{
+    // Grow by starting workers, shrink by queueing poison pills
+    mtx_lock(&p->mtx);
+    pool_reap(p);
+    if(nthreads > p->nthreads)
+    {
+        pool_spawn(p, nthreads - p->nthreads);
+    }
+    else
+    {
+        pool_retire(p, p->nthreads - nthreads);
+    }
+    mtx_unlock(&p->mtx);
+}
+
+void pool_caller_runs(pool_t* p, size_t depth)
+{
+    // Run submitted tasks in the caller once depth tasks are queued, 0 turns the policy off
+    p->caller_runs_depth = depth;
+}
+
+size_t pool_threads(pool_t* p)
+{
+    // Return the target number of workers
+    size_t n;
+    mtx_lock(&p->mtx);
+    n = p->nthreads;
+    mtx_unlock(&p->mtx);
+    return n;
+}
+
+size_t pool_completed(pool_t* p)
+{
+    // Return the number of tasks completed so far, without taking a lock
+    return p->completed;
+}
+
+size_t pool_stats(pool_t* p, pool_worker_stats* out, size_t max)
+{
+    // Copy the idle/busy metrics of up to max live workers, return how many were copied. A worker that took a
+    // poison pill is still listed until it has stopped
+    size_t n = 0;
+    pool_worker* w;
+    mtx_lock(&p->mtx);
+    for(w = p->workers; w != NULL && n < max; w = w->next)
+    {
+        if(w->retired)
+        {
+            continue;
+        }
+        out[n].busy_ns = w->busy_ns;
+        out[n].idle_ns = w->idle_ns;
+        out[n].tasks = w->tasks;
+        n++;
+    }
+    mtx_unlock(&p->mtx);
+    return n;
+}
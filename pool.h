@@ -0,0 +1,21 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stddef.h>
+#include <stdbool.h>
+typedef struct pool pool_t;
+typedef struct pool_worker_stats
+{
+    unsigned long long busy_ns; // time spent running tasks
+    unsigned long long idle_ns; // time spent blocked waiting for a task
+    unsigned long long tasks; // tasks completed by the worker
+} pool_worker_stats;
+pool_t* pool_create(size_t);
+void pool_destroy(pool_t*);
+void pool_submit(pool_t*, int (*)(void*), void*);
+void pool_wait(pool_t*);
+void pool_resize(pool_t*, size_t);
+void pool_caller_runs(pool_t*, size_t);
+size_t pool_threads(pool_t*);
+size_t pool_completed(pool_t*);
+size_t pool_stats(pool_t*, pool_worker_stats*, size_t);
+#endif
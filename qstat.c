@@ -0,0 +1,137 @@
+// Print the counters a queue publishes with exportStats, without touching the queue: the page is mapped read-only and
+// read under its seqlock, so polling costs the producer and consumer threads nothing.
+// gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -pthread qstat.c -o qstat
+// usage: ./qstat name [interval_ms]
+// With an interval it prints a line every interval_ms, with the rates since the previous line, until the queue
+// stops exporting; otherwise it prints the counters once together with the wait histogram.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "queue.h"
+
+typedef struct stats_copy
+{
+    uint64_t updated_us;
+    uint64_t depth;
+    uint64_t waiting;
+    uint64_t enqueued;
+    uint64_t dequeued;
+    uint64_t handoffs;
+    uint64_t wait_us[QUEUE_STATS_BUCKETS];
+} stats_copy;
+
+void read_page(queue_stats_page* page, stats_copy* s)
+{
+    // Copy a consistent snapshot: retry while the writer is mid-update or finished one while we were copying
+    uint64_t seq;
+    do
+    {
+        seq = atomic_load_explicit(&page->seq, memory_order_acquire);
+        s->updated_us = atomic_load_explicit(&page->updated_us, memory_order_relaxed);
+        s->depth = atomic_load_explicit(&page->depth, memory_order_relaxed);
+        s->waiting = atomic_load_explicit(&page->waiting, memory_order_relaxed);
+        s->enqueued = atomic_load_explicit(&page->enqueued, memory_order_relaxed);
+        s->dequeued = atomic_load_explicit(&page->dequeued, memory_order_relaxed);
+        s->handoffs = atomic_load_explicit(&page->handoffs, memory_order_relaxed);
+        for(int i = 0; i < QUEUE_STATS_BUCKETS; i++)
+        {
+            s->wait_us[i] = atomic_load_explicit(&page->wait_us[i], memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+    } while((seq & 1) || seq != atomic_load_explicit(&page->seq, memory_order_relaxed));
+}
+
+void print_histogram(const stats_copy* s)
+{
+    // One line per non-empty bucket of the wait histogram
+    uint64_t total = 0;
+    for(int i = 0; i < QUEUE_STATS_BUCKETS; i++)
+    {
+        total += s->wait_us[i];
+    }
+    printf("blocking dequeue waits: %llu\n", (unsigned long long) total);
+    for(int i = 0; i < QUEUE_STATS_BUCKETS; i++)
+    {
+        if(s->wait_us[i] > 0)
+        {
+            printf("  %s%9llu us  %llu\n", i == QUEUE_STATS_BUCKETS - 1 ? ">=" : " <",
+                   i == QUEUE_STATS_BUCKETS - 1 ? 1ULL << i : 2ULL << i, (unsigned long long) s->wait_us[i]);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    queue_stats_page* page;
+    stats_copy prev;
+    stats_copy cur;
+    unsigned interval_ms = 0;
+    double dt;
+    int fd;
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: %s name [interval_ms]\n", argv[0]);
+        return 2;
+    }
+    if(argc > 2)
+    {
+        interval_ms = (unsigned) strtoul(argv[2], NULL, 10);
+    }
+    fd = shm_open(argv[1], O_RDONLY, 0);
+    if(fd < 0)
+    {
+        fprintf(stderr, "qstat: no queue exports %s\n", argv[1]);
+        return 1;
+    }
+    page = mmap(NULL, sizeof(queue_stats_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(page == MAP_FAILED || atomic_load_explicit(&page->magic, memory_order_acquire) != QUEUE_STATS_MAGIC)
+    {
+        fprintf(stderr, "qstat: %s is not a queue stats page\n", argv[1]);
+        return 1;
+    }
+
+    read_page(page, &cur);
+    if(interval_ms == 0)
+    {
+        printf("depth %llu  waiting %llu  enqueued %llu  dequeued %llu  handoffs %llu\n",
+               (unsigned long long) cur.depth, (unsigned long long) cur.waiting, (unsigned long long) cur.enqueued,
+               (unsigned long long) cur.dequeued, (unsigned long long) cur.handoffs);
+        print_histogram(&cur);
+        munmap(page, sizeof(queue_stats_page));
+        return 0;
+    }
+    printf("%10s %10s %12s %12s %12s\n", "depth", "waiting", "enq/s", "deq/s", "handoff/s");
+    //the object is unlinked when the queue stops exporting, our mapping just stops changing
+    while(true)
+    {
+        prev = cur;
+        thrd_sleep(&(struct timespec){interval_ms / 1000, (long) (interval_ms % 1000) * 1000000L}, NULL);
+        read_page(page, &cur);
+        if(cur.updated_us == prev.updated_us)
+        {
+            if((fd = shm_open(argv[1], O_RDONLY, 0)) < 0)
+            {
+                break;
+            }
+            close(fd);
+        }
+        dt = cur.updated_us > prev.updated_us ? (cur.updated_us - prev.updated_us) / 1e6 : interval_ms / 1e3;
+        printf("%10llu %10llu %12.0f %12.0f %12.0f\n", (unsigned long long) cur.depth,
+               (unsigned long long) cur.waiting, (cur.enqueued - prev.enqueued) / dt,
+               (cur.dequeued - prev.dequeued) / dt, (cur.handoffs - prev.handoffs) / dt);
+        fflush(stdout);
+    }
+    print_histogram(&cur);
+    munmap(page, sizeof(queue_stats_page));
+    return 0;
+}
@@ -4,13 +4,35 @@
 #include <unistd.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "queue.h"
+
+#define QUEUE_MAX_BACKENDS 8
+#define CHUNK_ITEMS 1024 // ready items per chunk of the unrolled ready list
+#define CHUNK_FREE_MAX 4 // emptied chunks kept for reuse
+#define SPILL_SEG_ITEMS 4096 // items per spill segment file
+#define SPILL_FREE_MAX 2 // consumed segments kept mapped for reuse
+#define CACHE_LINE 64 // bytes, the alignment of each combine slot
+#define COMBINE_SLOTS 64 // threads that can publish to the combiner at once, the others take the lock directly
+#define COMBINE_NO_SLOT ((void*) -1)
+#define STAGE_ITEMS 64 // items a producer thread buffers before enqueueBuffered publishes them
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS) // slots per wheel level, each level is TIMER_SLOTS times coarser than the one below
+#define TIMER_LEVELS 4 // with 1 ms ticks the wheel spans 2^24 ms, later items are parked in the top level and re-placed
+#define ANY_STACK_REGS 8 // queues dequeueAny registers in without allocating
+#define WAKE_SCAN 8 // waiters WAKE_AFFINITY looks at for one with the producer's hint
+#define TRACE_RING_RECS 4096 // records a thread buffers before writing them to the trace file
+#define TRACE_MAGIC "QTRACE1\n" // first bytes of a trace file, followed by trace_rec records
 
 typedef struct node_fifo
 {
-    void* data; //for item queue it will be void*, for cnd it will be cnd_t*
+    void* data;
     struct node_fifo* next;
     struct node_fifo* prev;
-    struct node_fifo* parent; // to point to another nodes in other ll
+    size_t bytes; // caller-declared payload size of the item
 } node;
 
 typedef struct queue
@@ -20,14 +42,210 @@ typedef struct queue
     size_t size;
 } queue;
 
-queue* fifo_q;
-queue* cnd_q;
-mtx_t mtx;
-queue* ready_q;
-node* sig_p;
+typedef struct chunk
+{
+    struct chunk* next;
+    size_t head; // next slot to take
+    size_t tail; // next slot to fill
+    size_t* bytes; // declared payload sizes, NULL until a sized item lands in this chunk
+    void* items[CHUNK_ITEMS];
+} chunk;
+
+typedef struct chunk_list
+{
+    chunk* head; // oldest chunk, items are taken from it
+    chunk* tail; // newest chunk, items are appended to it
+    chunk* free; // emptied chunks kept for reuse
+    size_t free_cnt;
+    size_t size;
+} chunk_list;
+
+typedef struct spill_segment
+{
+    int fd; // -1 for a segment kept in memory because the disk tier could not grow
+    char* base; // mmap'd view of the segment file
+    size_t head; // next slot to read back
+    size_t tail; // next slot to append
+    unsigned char nulls[SPILL_SEG_ITEMS / 8]; // slots holding a NULL item, which has no payload to copy
+    struct spill_segment* next;
+} spill_seg;
+
+typedef struct flow
+{
+    queue* items; // this flow's sub-FIFO
+    size_t weight; // items served per round
+    size_t deficit; // items it may still take in the current round
+    bool active; // linked into the active ring
+    struct flow* next; // next active flow in the ring
+} flow;
+
+typedef struct stats_export
+{
+    queue_t* q;
+    queue_stats_page* page; // shared mapping the monitoring tools read
+    char* name; // shm object name, unlinked by unexportStats
+    unsigned period_ms;
+    mtx_t mtx; // guards stop, never taken by the queue's operations
+    cnd_t cnd;
+    bool stop;
+    thrd_t thread;
+} stats_export;
+
+typedef struct timer_entry
+{
+    void* data;
+    uint64_t due; // tick the item becomes ready
+    struct timer_entry* next;
+} timer_entry;
+
+typedef struct timer_slot
+{
+    timer_entry* head; // oldest first, so items due on the same tick keep their order
+    timer_entry* tail;
+} timer_slot;
+
+typedef struct timer_wheel
+{
+    timer_slot slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t now; // last tick processed, every pending item is due later
+    uint64_t base_ms; // monotonic clock of tick 0
+    uint64_t wake; // tick the timer thread sleeps until, UINT64_MAX while nothing is pending
+    size_t cnt; // items pending
+    bool stop;
+    cnd_t cnd; // the timer thread sleeps on it, under the queue's mtx
+    thrd_t thread;
+} timer_wheel;
+
+typedef enum waiter_kind
+{
+    WAIT_PLAIN, // a thread blocked in dequeue, sleeping on the queue's mtx
+    WAIT_ANY, // a thread blocked in dequeueAny, registered in several queues at once
+    WAIT_ASYNC, // a continuation registered by dequeueAsync, no thread is blocked
+    WAIT_BATCH, // a thread blocked in dequeueBatch, stays at the head collecting items until it has its minimum
+} waiter_kind;
+
+typedef void (*dequeue_callback)(void*, void*);
+
+typedef struct wait_link
+{
+    struct wait_link* prev;
+    struct wait_link* next;
+    struct waiter* owner;
+    bool linked; // still in the queue's waiter list, changed under the queue's mtx
+} wait_link;
+
+typedef struct waiter
+{
+    waiter_kind kind;
+    cnd_t cnd;
+    mtx_t mtx; // WAIT_ANY only: guards the fields below, taken after the queue's mtx
+    bool done;
+    void* data;
+    queue_t* from; // the queue that handed the item
+    dequeue_callback callback; // WAIT_ASYNC only, called as callback(item, ctx)
+    void* ctx;
+    void** batch; // WAIT_BATCH only: items collected so far, got of them, woken once min are in
+    size_t got;
+    size_t min;
+    int hint; // affinity hint of the thread that registered, -1 for none
+    wait_link link; // WAIT_PLAIN, WAIT_ASYNC and WAIT_BATCH, a WAIT_ANY waiter has one link per queue instead
+} waiter;
+
+typedef enum slot_state
+{
+    SLOT_EMPTY,
+    SLOT_PENDING, // published by its thread, waiting for a combiner
+    SLOT_DONE, // applied, the result fields are valid
+} slot_state;
+
+typedef enum slot_op
+{
+    OP_ENQUEUE,
+    OP_TRY_DEQUEUE,
+} slot_op;
+
+typedef struct combine_slot
+{
+    _Alignas(CACHE_LINE) atomic_int state; // one slot per cache line, publishing threads do not share lines
+    slot_op op;
+    void* data; // item to enqueue, or the item dequeued
+    size_t id; // flow of the item to enqueue
+    size_t bytes; // declared payload size of the item to enqueue
+    bool ok; // whether the try-dequeue got an item
+} combine_slot;
+_Static_assert(sizeof(combine_slot) == CACHE_LINE, "a combine slot must fill exactly one cache line");
+
+struct queue_handle
+{
+    chunk_list ready; // items nobody was waiting for, in FIFO order; handed items never enter it
+    wait_link* wait_head; // live waiters only, oldest first; records belong to the waiters so nothing piles up
+    wait_link* wait_tail;
+    mtx_t mtx;
+
+    atomic_size_t enqueued_cnt; // size is enqueued_cnt - visited_cnt, so it can be read without the lock
+    atomic_size_t visited_cnt;
+    atomic_int waiting_cnt; // length of the waiter list
+    atomic_int wake; // wake_policy, which waiter an item is handed to
+
+    char* spill_dir; // NULL while spilling is disabled
+    size_t spill_item_size;
+    size_t spill_high_water;
+    size_t spill_cnt; // items currently living on disk
+    spill_seg* spill_head; // oldest segment, read side
+    spill_seg* spill_tail; // newest segment, append side
+    spill_seg* spill_free; // consumed segments waiting to be reused
+    size_t spill_free_cnt;
+
+    flow* flows; // NULL while fair mode is off
+    size_t nflows;
+    flow* ring_tail; // active flows form a ring, the one after ring_tail is served next
+    size_t fair_cnt; // items queued in the flows
+
+    atomic_bool combining; // enqueue/tryDequeue go through the slots below
+    combine_slot slots[COMBINE_SLOTS]; // indexed by the thread's combine id
+
+    size_t mem_nodes; // bytes of chunks and list nodes holding queued items
+    size_t mem_waiters; // bytes of heap waiter records, stack-resident waiters cost the queue nothing
+    size_t mem_payload; // declared payload bytes of queued items
+    atomic_size_t mem_soft; // enqueue blocks past this many bytes, 0 for no limit
+    atomic_size_t mem_hard; // enqueueSized fails past this many bytes, 0 for no limit
+    cnd_t space_cnd; // producers blocked at a limit, signalled when items leave
+    size_t space_waiters;
+
+    timer_wheel* timers; // items of enqueueAfter, NULL until the first one
+
+    atomic_size_t handoffs; // items given straight to a waiter, never queued
+    atomic_size_t wait_hist[QUEUE_STATS_BUCKETS]; // sleeps of blocking dequeues, counted while the stats are exported
+    stats_export* stats; // NULL unless exportStats was called, changed under the mtx
+
+    struct stage* stages; // staging buffers of the threads that enqueueBuffered to this queue
+};
+
+queue_t main_q; // the queue behind initQueue/enqueue/dequeue/... when the list backend is selected
+const queue_backend* active_backend; // NULL until the first initQueue or selectBackend
+
+once_flag combine_once = ONCE_FLAG_INIT;
+tss_t combine_key; // holds the thread's combine id + 1, or COMBINE_NO_SLOT
+mtx_t combine_ids_mtx;
+int combine_free_ids[COMBINE_SLOTS]; // ids released by exited threads
+size_t combine_free_cnt;
+atomic_int combine_ids_hi; // ids below this were handed out at least once, combiners scan up to it
+
+once_flag hint_once = ONCE_FLAG_INIT;
+tss_t hint_key; // the thread's affinity hint + 1, NULL for none
+
+typedef struct stage
+{
+    _Atomic(queue_t*) q; // the queue the buffer is registered with, NULL while it is not bound to one
+    mtx_t mtx; // guards n and items against consumers collecting them, taken after the queue's mtx
+    size_t n;
+    void* items[STAGE_ITEMS];
+    struct stage* prev; // links in the registry of q, changed under its mtx
+    struct stage* next;
+} stage;
 
-atomic_int visited_cnt;
-atomic_int waiting_cnt;
+once_flag stage_once = ONCE_FLAG_INIT;
+tss_t stage_key; // the thread's staging buffer, allocated on its first enqueueBuffered
 
 void* dequeue_ll(queue* q)
 {
@@ -49,29 +267,6 @@ void* dequeue_ll(queue* q)
     return p;
 }
 
-void* remove_node_from_list(queue* q, node* n)
-{
-    // Remove a specific node from the linked list (ll) and return the data stored in the node
-    void* p;
-    if (n->prev == NULL) //n is head of list
-    {
-        return dequeue_ll(q);
-    }
-    p = n->data;
-    q->size--;
-    if(n->next == NULL)
-    {
-        q->tail = n->prev;
-        q->tail->next = NULL;
-        free(n);   
-        return p;
-    }
-    n->prev = n->prev->prev;
-    n->next  = n->next ->next;
-    free(n);
-    return p;
-}
-
 void* enqueue_ll(queue* q, void* data)
 {
     // Add a new node with the given data to the tail of the linked list (ll) and return the newly created node
@@ -79,6 +274,7 @@ void* enqueue_ll(queue* q, void* data)
     p->data = data;
     p->prev = q->tail;
     p->next = NULL;
+    p->bytes = 0;
     if(q->tail == NULL)
     {
         q->head = p;
@@ -102,126 +298,2565 @@ void* init_ll()
     return q;
 }
 
-size_t size(void)
+queue_t* list_queue(void)
 {
-    // Return the current size of the FIFO queue
-    return fifo_q->size;
+    // Return main_q if the active backend keeps its items there, NULL otherwise: the extended API on the default queue
+    // only works with the list backends, with any other one its items would go to a queue nobody dequeues from
+    return active_backend == &list_backend || active_backend == &combining_backend ? &main_q : NULL;
 }
 
-size_t waiting(void)
+void chunk_append(queue_t* q, void* data, size_t bytes)
 {
-    // Return the number of threads waiting in the FIFO queue
-    mtx_lock(&mtx);
-    size_t w;
-    w = (size_t) waiting_cnt;
-    mtx_unlock(&mtx);
-    return w;
+    // Put the item in the next slot of the tail chunk, starting a new chunk when it is full
+    chunk_list* l = &q->ready;
+    chunk* c = l->tail;
+    if(c == NULL || c->tail == CHUNK_ITEMS)
+    {
+        if(l->free != NULL)
+        {
+            c = l->free;
+            l->free = c->next;
+            l->free_cnt--;
+        }
+        else
+        {
+            c = malloc(sizeof(chunk));
+            q->mem_nodes += sizeof(chunk);
+        }
+        c->next = NULL;
+        c->head = 0;
+        c->tail = 0;
+        c->bytes = NULL;
+        if(l->tail == NULL)
+        {
+            l->head = c;
+        }
+        else
+        {
+            l->tail->next = c;
+        }
+        l->tail = c;
+    }
+    if(bytes > 0 && c->bytes == NULL)
+    {
+        //sizes are rare, only chunks that hold a sized item pay for the array
+        c->bytes = calloc(CHUNK_ITEMS, sizeof(size_t));
+        q->mem_nodes += CHUNK_ITEMS * sizeof(size_t);
+    }
+    if(c->bytes != NULL)
+    {
+        c->bytes[c->tail] = bytes;
+    }
+    c->items[c->tail++] = data;
+    l->size++;
 }
 
-size_t visited()
+void chunk_release(queue_t* q, chunk* c)
 {
-    // Return the number of items dequeued from the FIFO queue
-    return (size_t) visited_cnt;
+    // Recycle an emptied chunk, or free it if enough are kept already
+    chunk_list* l = &q->ready;
+    if(c->bytes != NULL)
+    {
+        free(c->bytes);
+        c->bytes = NULL;
+        q->mem_nodes -= CHUNK_ITEMS * sizeof(size_t);
+    }
+    if(l->free_cnt < CHUNK_FREE_MAX)
+    {
+        c->next = l->free;
+        l->free = c;
+        l->free_cnt++;
+        return;
+    }
+    free(c);
+    q->mem_nodes -= sizeof(chunk);
 }
 
-void initQueue(void)
+void* chunk_take(queue_t* q, size_t* bytes)
 {
-    // Initialize the FIFO queue and other data structures
-    mtx_init(&mtx, mtx_plain);
-    fifo_q = init_ll();
-    cnd_q = init_ll();
-    ready_q = init_ll();
-    visited_cnt = 0;
-    waiting_cnt = 0;
-    enqueue_ll(cnd_q, (node*) malloc(sizeof(node))); //just a sentinel
-    sig_p = cnd_q->head;
+    // Take the item in the head chunk's next slot, the caller made sure the list is not empty
+    chunk_list* l = &q->ready;
+    chunk* c = l->head;
+    void* data = c->items[c->head];
+    *bytes = c->bytes != NULL ? c->bytes[c->head] : 0;
+    c->head++;
+    l->size--;
+    if(c->head == c->tail)
+    {
+        if(c->next != NULL)
+        {
+            l->head = c->next;
+            chunk_release(q, c);
+        }
+        else
+        {
+            //the only chunk left, rewind it instead of recycling
+            c->head = 0;
+            c->tail = 0;
+            if(c->bytes != NULL)
+            {
+                free(c->bytes);
+                c->bytes = NULL;
+                q->mem_nodes -= CHUNK_ITEMS * sizeof(size_t);
+            }
+        }
+    }
+    return data;
 }
 
-void destroyQueue(void)
+void chunk_destroy(queue_t* q)
 {
-    // Clean up the memory and resources used by the FIFO queue
-    mtx_destroy(&mtx);
-    while(fifo_q->head!=NULL)
+    // Free every chunk, the items still in them are dropped
+    chunk* c;
+    while(q->ready.head != NULL)
+    {
+        c = q->ready.head;
+        q->ready.head = c->next;
+        free(c->bytes);
+        free(c);
+    }
+    while(q->ready.free != NULL)
     {
-        dequeue_ll(fifo_q);
+        c = q->ready.free;
+        q->ready.free = c->next;
+        free(c);
     }
-    free(fifo_q);
+}
 
-    while(cnd_q->head!=NULL)
+spill_seg* spill_new_seg(queue_t* q, bool in_memory)
+{
+    // Get an empty segment, reusing a consumed one if possible, otherwise create a new unlinked file and map it.
+    // NULL if no file can be created, unless in_memory allows falling back to a heap segment
+    spill_seg* seg;
+    char* path;
+    size_t len = SPILL_SEG_ITEMS * q->spill_item_size;
+    if(q->spill_free != NULL)
+    {
+        seg = q->spill_free;
+        q->spill_free = seg->next;
+        q->spill_free_cnt--;
+    }
+    else
     {
-        dequeue_ll(cnd_q);
+        path = malloc(strlen(q->spill_dir) + sizeof("/queue-spill-XXXXXX"));
+        strcpy(path, q->spill_dir);
+        strcat(path, "/queue-spill-XXXXXX");
+        seg = malloc(sizeof(spill_seg));
+        seg->fd = mkstemp(path);
+        if(seg->fd >= 0)
+        {
+            unlink(path); //the file lives only as long as the mapping does
+            if(ftruncate(seg->fd, len) != 0 ||
+               (seg->base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0)) == MAP_FAILED)
+            {
+                close(seg->fd);
+                seg->fd = -1;
+            }
+        }
+        free(path);
+        if(seg->fd < 0)
+        {
+            if(!in_memory)
+            {
+                free(seg);
+                return NULL;
+            }
+            //the disk is full or gone, keep the FIFO order in a segment that counts as queue memory
+            seg->base = malloc(len);
+            q->mem_nodes += len;
+        }
     }
-    free(cnd_q);
+    seg->head = 0;
+    seg->tail = 0;
+    memset(seg->nulls, 0, sizeof(seg->nulls));
+    seg->next = NULL;
+    return seg;
+}
 
-    while(ready_q->head!=NULL)
+void spill_release_seg(queue_t* q, spill_seg* seg)
+{
+    // Recycle a fully consumed segment, or unmap it if enough are already kept for reuse
+    if(seg->fd < 0)
     {
-        dequeue_ll(ready_q);
+        q->mem_nodes -= SPILL_SEG_ITEMS * q->spill_item_size;
+        free(seg->base);
+        free(seg);
+        return;
     }
-    free(ready_q);
+    if(q->spill_free_cnt < SPILL_FREE_MAX)
+    {
+        posix_madvise(seg->base, SPILL_SEG_ITEMS * q->spill_item_size, POSIX_MADV_DONTNEED);
+        seg->next = q->spill_free;
+        q->spill_free = seg;
+        q->spill_free_cnt++;
+        return;
+    }
+    munmap(seg->base, SPILL_SEG_ITEMS * q->spill_item_size);
+    close(seg->fd);
+    free(seg);
 }
 
-void enqueue(void* data)
+bool spill_needed(queue_t* q)
 {
-    // Add the data to the FIFO queue
-    mtx_lock(&mtx);
-    node* n = enqueue_ll(fifo_q, data);
-    
-    if(sig_p->next == NULL)
+    // Does the next item queued go to disk? The caller holds the queue's mtx
+    return q->spill_dir != NULL && (q->spill_cnt > 0 || q->ready.size >= q->spill_high_water);
+}
+
+bool spill_reserve(queue_t* q)
+{
+    // Make sure an item about to be spilled has a slot on disk, false if the disk tier cannot grow
+    spill_seg* seg;
+    if(!spill_needed(q) || q->spill_tail->tail < SPILL_SEG_ITEMS)
+    {
+        return true;
+    }
+    if((seg = spill_new_seg(q, false)) == NULL)
+    {
+        return false;
+    }
+    q->spill_tail->next = seg;
+    q->spill_tail = seg;
+    return true;
+}
+
+void spill_append(queue_t* q, void* data)
+{
+    // Serialize the payload into the tail segment and free the in-memory copy. Enqueues reserve their slot first;
+    // items that cannot wait (due timers, staged batches, the combiner) get a heap segment if the disk is full
+    spill_seg* seg = q->spill_tail;
+    if(seg->tail == SPILL_SEG_ITEMS)
     {
-        enqueue_ll(ready_q, n);
+        seg = spill_new_seg(q, true);
+        q->spill_tail->next = seg;
+        q->spill_tail = seg;
+    }
+    if(data == NULL)
+    {
+        //a NULL item (e.g. a pill) keeps its place in the order without a payload
+        seg->nulls[seg->tail / 8] |= 1 << (seg->tail % 8);
     }
     else
     {
-        sig_p = sig_p->next;
-        sig_p ->parent = n;
-        cnd_signal((cnd_t *) sig_p->data);
+        memcpy(seg->base + seg->tail * q->spill_item_size, data, q->spill_item_size);
+        free(data);
     }
-    mtx_unlock(&mtx);
+    seg->tail++;
+    q->spill_cnt++;
 }
 
-void* dequeue()
+void* spill_read(queue_t* q)
 {
-    // Remove and return an item from the FIFO queue
-    mtx_lock(&mtx);
-    void* data;
-    if(ready_q->head == NULL)
-    {
-        //there is no item ready to dequeue
-        node* n;
-        cnd_t cnd;
-        cnd_init(&cnd);
-        n = enqueue_ll(cnd_q, &cnd);
-        waiting_cnt++;
-        cnd_wait(&cnd, &mtx);
-        //now i have an item to dequeue
-        waiting_cnt--;
-        data = remove_node_from_list(fifo_q, n->parent);
-        cnd_destroy(&cnd);
-        visited_cnt++; 
-        mtx_unlock(&mtx);
-        return data;
+    // Materialize the oldest spilled payload into a fresh allocation, NULL for a NULL item
+    void* data = NULL;
+    spill_seg* seg = q->spill_head;
+    if(seg->nulls[seg->head / 8] & (1 << (seg->head % 8)))
+    {
+        seg->nulls[seg->head / 8] &= ~(1 << (seg->head % 8));
     }
     else
     {
-        //there is an item ready to dequeue
-        data = remove_node_from_list(fifo_q, dequeue_ll(ready_q));
-        visited_cnt++;
-        mtx_unlock(&mtx);
-        return data;
+        data = malloc(q->spill_item_size);
+        memcpy(data, seg->base + seg->head * q->spill_item_size, q->spill_item_size);
+    }
+    seg->head++;
+    q->spill_cnt--;
+    if(seg->head == seg->tail)
+    {
+        if(seg->next == NULL)
+        {
+            //the only segment left, rewind it instead of recycling
+            seg->head = 0;
+            seg->tail = 0;
+        }
+        else
+        {
+            q->spill_head = seg->next;
+            spill_release_seg(q, seg);
+        }
     }
+    return data;
 }
 
-bool tryDequeue(void** point)
+void spill_refill(queue_t* q)
 {
-    // Try to remove and return an item from the FIFO queue, return false if the queue is empty, and true if an item was dequeued
-    mtx_lock(&mtx);
-    if(ready_q->head == NULL)
+    // Once the in-memory part drained to half the high-water mark, read a batch back from disk in FIFO order
+    if(q->spill_cnt == 0 || q->ready.size > q->spill_high_water / 2)
+    {
+        return;
+    }
+    void* data;
+    size_t bytes;
+    while(q->spill_cnt > 0 && q->ready.size < q->spill_high_water)
+    {
+        data = spill_read(q);
+        bytes = data != NULL ? q->spill_item_size : 0;
+        chunk_append(q, data, bytes);
+        q->mem_payload += bytes;
+    }
+}
+
+void spill_destroy(queue_t* q)
+{
+    // Unmap every segment; spilled payloads that were never dequeued are dropped with them
+    spill_seg* seg;
+    if(q->spill_dir == NULL)
+    {
+        return;
+    }
+    while(q->spill_head != NULL)
+    {
+        seg = q->spill_head;
+        q->spill_head = seg->next;
+        spill_release_seg(q, seg);
+    }
+    while(q->spill_free != NULL)
+    {
+        seg = q->spill_free;
+        q->spill_free = seg->next;
+        //only file segments are recycled
+        munmap(seg->base, SPILL_SEG_ITEMS * q->spill_item_size);
+        close(seg->fd);
+        free(seg);
+    }
+    free(q->spill_dir);
+    q->spill_dir = NULL;
+}
+
+bool initSpill(const char* dir, size_t item_size, size_t high_water)
+{
+    // Enable the disk tier: past high_water ready items, payloads of item_size bytes are moved into segment files under dir.
+    // Spilled payloads must be malloc'ed blocks owned by the queue; they come back from dequeue as new malloc'ed copies,
+    // NULL items come back as NULL. If no more segment files can be created, enqueueSized fails and enqueue waits for
+    // consumers to drain the disk tier. false if spilling is already on or the active backend is not a list one.
+    queue_t* q = list_queue();
+    bool ok;
+    if(q == NULL)
+    {
+        return false;
+    }
+    mtx_lock(&q->mtx);
+    if(q->flows != NULL || q->spill_dir != NULL)
+    {
+        //flows are never spilled, the two modes do not mix; a second call would drop the segments already written
+        mtx_unlock(&q->mtx);
+        return false;
+    }
+    q->spill_dir = malloc(strlen(dir) + 1);
+    strcpy(q->spill_dir, dir);
+    q->spill_item_size = item_size;
+    q->spill_high_water = high_water > 0 ? high_water : 1;
+    q->spill_cnt = 0;
+    q->spill_free = NULL;
+    q->spill_free_cnt = 0;
+    q->spill_head = q->spill_tail = spill_new_seg(q, false);
+    ok = q->spill_head != NULL;
+    if(!ok)
+    {
+        free(q->spill_dir);
+        q->spill_dir = NULL;
+    }
+    mtx_unlock(&q->mtx);
+    return ok;
+}
+
+void fair_destroy(queue_t* q)
+{
+    // Free the flows and whatever is still queued in them
+    for(size_t i = 0; i < q->nflows; i++)
+    {
+        while(q->flows[i].items->head != NULL)
+        {
+            dequeue_ll(q->flows[i].items);
+        }
+        free(q->flows[i].items);
+    }
+    free(q->flows);
+    q->flows = NULL;
+    q->nflows = 0;
+}
+
+void fair_append(queue_t* q, void* data, size_t id, size_t bytes)
+{
+    // Queue the item in its flow and put the flow in the active ring if it was idle
+    flow* f = &q->flows[id % q->nflows];
+    node* n = enqueue_ll(f->items, data);
+    n->bytes = bytes;
+    q->mem_nodes += sizeof(node);
+    q->mem_payload += bytes;
+    q->fair_cnt++;
+    if(!f->active)
+    {
+        f->active = true;
+        f->deficit = 0;
+        if(q->ring_tail == NULL)
+        {
+            f->next = f;
+        }
+        else
+        {
+            f->next = q->ring_tail->next;
+            q->ring_tail->next = f;
+        }
+        q->ring_tail = f;
+    }
+}
+
+void* fair_take(queue_t* q)
+{
+    // Deficit round-robin: the flow after ring_tail gets weight items per round, then moves behind the others
+    flow* f = q->ring_tail->next;
+    void* data;
+    if(f->deficit == 0)
+    {
+        f->deficit = f->weight;
+    }
+    q->mem_nodes -= sizeof(node);
+    q->mem_payload -= f->items->head->bytes;
+    data = dequeue_ll(f->items);
+    f->deficit--;
+    q->fair_cnt--;
+    if(f->items->head == NULL)
+    {
+        //the flow drained, drop it from the ring until it gets items again
+        f->active = false;
+        f->deficit = 0;
+        if(f->next == f)
+        {
+            q->ring_tail = NULL;
+        }
+        else
+        {
+            q->ring_tail->next = f->next;
+        }
+    }
+    else if(f->deficit == 0)
+    {
+        //round over, the next flow is served next
+        q->ring_tail = f;
+    }
+    return data;
+}
+
+bool initFairness(size_t nflows)
+{
+    // Switch the queue to fair mode with flows 0..nflows-1 of weight 1. From now on plain enqueue feeds flow 0
+    // and dequeue serves the active flows by weighted deficit round-robin. Must be called while the queue is empty.
+    // false if the active backend is not a list one
+    queue_t* q = list_queue();
+    bool ok;
+    if(q == NULL)
     {
-        mtx_unlock(&mtx);
         return false;
     }
-    *point = remove_node_from_list(fifo_q, dequeue_ll(ready_q));
-    visited_cnt++;
-    mtx_unlock(&mtx);
+    mtx_lock(&q->mtx);
+    ok = nflows > 0 && q->flows == NULL && q->ready.size == 0 && q->spill_dir == NULL;
+    if(ok)
+    {
+        q->flows = malloc(nflows * sizeof(flow));
+        q->nflows = nflows;
+        for(size_t i = 0; i < nflows; i++)
+        {
+            q->flows[i].items = init_ll();
+            q->flows[i].weight = 1;
+            q->flows[i].deficit = 0;
+            q->flows[i].active = false;
+            q->flows[i].next = NULL;
+        }
+    }
+    mtx_unlock(&q->mtx);
+    return ok;
+}
+
+void setFlowWeight(size_t id, size_t weight)
+{
+    // Let the flow take weight items per round, takes effect from the flow's next round
+    queue_t* q = list_queue();
+    if(q == NULL)
+    {
+        return;
+    }
+    mtx_lock(&q->mtx);
+    if(q->flows != NULL)
+    {
+        q->flows[id % q->nflows].weight = weight > 0 ? weight : 1;
+    }
+    mtx_unlock(&q->mtx);
+}
+
+void init_queue(queue_t* q)
+{
+    // Initialize the lists, lock and counters of a queue
+    mtx_init(&q->mtx, mtx_plain);
+    q->ready.head = NULL;
+    q->ready.tail = NULL;
+    q->ready.free = NULL;
+    q->ready.free_cnt = 0;
+    q->ready.size = 0;
+    q->wait_head = NULL;
+    q->wait_tail = NULL;
+    q->enqueued_cnt = 0;
+    q->visited_cnt = 0;
+    q->waiting_cnt = 0;
+    q->wake = WAKE_FIFO;
+    q->spill_dir = NULL;
+    q->spill_cnt = 0;
+    q->flows = NULL;
+    q->nflows = 0;
+    q->ring_tail = NULL;
+    q->fair_cnt = 0;
+    q->combining = false;
+    for(size_t i = 0; i < COMBINE_SLOTS; i++)
+    {
+        q->slots[i].state = SLOT_EMPTY;
+    }
+    q->mem_nodes = 0;
+    q->mem_waiters = 0;
+    q->mem_payload = 0;
+    q->mem_soft = 0;
+    q->mem_hard = 0;
+    cnd_init(&q->space_cnd);
+    q->space_waiters = 0;
+    q->timers = NULL;
+    q->handoffs = 0;
+    for(size_t i = 0; i < QUEUE_STATS_BUCKETS; i++)
+    {
+        q->wait_hist[i] = 0;
+    }
+    q->stats = NULL;
+    q->stages = NULL;
+}
+
+void timer_destroy(queue_t* q)
+{
+    // Stop the timer thread and drop the items that never became due
+    timer_wheel* w = q->timers;
+    timer_entry* e;
+    if(w == NULL)
+    {
+        return;
+    }
+    mtx_lock(&q->mtx);
+    w->stop = true;
+    cnd_signal(&w->cnd);
+    mtx_unlock(&q->mtx);
+    thrd_join(w->thread, NULL);
+    for(int l = 0; l < TIMER_LEVELS; l++)
+    {
+        for(int i = 0; i < TIMER_SLOTS; i++)
+        {
+            while((e = w->slots[l][i].head) != NULL)
+            {
+                w->slots[l][i].head = e->next;
+                free(e);
+            }
+        }
+    }
+    cnd_destroy(&w->cnd);
+    free(w);
+    q->timers = NULL;
+}
+
+void stage_detach(queue_t* q)
+{
+    // Forget the staging buffers bound to a queue that goes away; their items are dropped like the queued ones,
+    // so neither a later flush nor the thread's exit touches the queue again
+    stage* st;
+    mtx_lock(&q->mtx);
+    while((st = q->stages) != NULL)
+    {
+        q->stages = st->next;
+        mtx_lock(&st->mtx);
+        st->q = NULL;
+        st->n = 0;
+        st->prev = st->next = NULL;
+        mtx_unlock(&st->mtx);
+    }
+    mtx_unlock(&q->mtx);
+}
+
+void destroy_queue(queue_t* q)
+{
+    // Clean up the memory and resources used by a queue
+    unexportStats(q);
+    timer_destroy(q);
+    stage_detach(q);
+    mtx_destroy(&q->mtx);
+    cnd_destroy(&q->space_cnd);
+    spill_destroy(q);
+    fair_destroy(q);
+    chunk_destroy(q);
+
+    //continuations that were never served are owned by the queue
+    while(q->wait_head != NULL)
+    {
+        waiter* wt = q->wait_head->owner;
+        q->wait_head = q->wait_head->next;
+        if(wt->kind == WAIT_ASYNC)
+        {
+            free(wt);
+        }
+    }
+}
+
+void wait_push(queue_t* q, wait_link* l, waiter* owner)
+{
+    // Register a waiter at the tail of the waiter list, the caller holds the queue's mtx
+    l->owner = owner;
+    l->next = NULL;
+    l->prev = q->wait_tail;
+    if(q->wait_tail == NULL)
+    {
+        q->wait_head = l;
+    }
+    else
+    {
+        q->wait_tail->next = l;
+    }
+    q->wait_tail = l;
+    l->linked = true;
+    q->waiting_cnt++;
+}
+
+void wait_unlink(queue_t* q, wait_link* l)
+{
+    // Take a waiter out of the list wherever it is, the caller holds the queue's mtx
+    if(l->prev == NULL)
+    {
+        q->wait_head = l->next;
+    }
+    else
+    {
+        l->prev->next = l->next;
+    }
+    if(l->next == NULL)
+    {
+        q->wait_tail = l->prev;
+    }
+    else
+    {
+        l->next->prev = l->prev;
+    }
+    l->linked = false;
+    q->waiting_cnt--;
+}
+
+bool has_ready(queue_t* q)
+{
+    // Is there an item a newcomer may take right away? The caller holds the queue's mtx
+    return q->ready.size > 0 || q->fair_cnt > 0;
+}
+
+void* take_ready(queue_t* q)
+{
+    // Remove the next ready item, the caller holds the queue's mtx and made sure has_ready is true
+    void* data;
+    size_t bytes;
+    if(q->ready.size > 0)
+    {
+        data = chunk_take(q, &bytes);
+        q->mem_payload -= bytes;
+        spill_refill(q);
+    }
+    else
+    {
+        data = fair_take(q);
+    }
+    q->visited_cnt++;
+    if(q->space_waiters > 0)
+    {
+        //room was made, blocked producers recheck the limits
+        cnd_broadcast(&q->space_cnd);
+    }
+    return data;
+}
+
+uint64_t clock_ns(void)
+{
+    // Monotonic time in nanoseconds, setting the wall clock does not move it
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+struct timespec deadline_after(uint64_t ns)
+{
+    // The absolute deadline ns from now for cnd_timedwait, which only takes the wall clock
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    ns += (uint64_t) ts.tv_nsec;
+    ts.tv_sec += (time_t) (ns / 1000000000ULL);
+    ts.tv_nsec = (long) (ns % 1000000000ULL);
+    return ts;
+}
+
+void hint_init(void)
+{
+    // One time setup of the affinity hint key
+    tss_create(&hint_key, NULL);
+}
+
+int wake_hint(void)
+{
+    // Return the calling thread's affinity hint, -1 if it never set one
+    call_once(&hint_once, hint_init);
+    return (int) ((intptr_t) tss_get(hint_key) - 1);
+}
+
+wait_link* wake_pick(queue_t* q)
+{
+    // Choose the waiter the next item goes to, NULL if nobody is waiting. The caller holds the queue's mtx.
+    // FIFO wakes the longest sleeper, LIFO the most recent one, whose cache is still warm; AFFINITY prefers
+    // a recent waiter with the producer's hint and falls back to LIFO
+    wait_link* l = q->wait_tail;
+    int hint;
+    if(q->wake == WAKE_FIFO)
+    {
+        return q->wait_head;
+    }
+    if(q->wake == WAKE_AFFINITY && (hint = wake_hint()) >= 0)
+    {
+        for(int i = 0; i < WAKE_SCAN && l != NULL; i++, l = l->prev)
+        {
+            if(l->owner->hint == hint)
+            {
+                return l;
+            }
+        }
+    }
+    return q->wait_tail;
+}
+
+bool hand_to_waiter(queue_t* q, void* data, waiter** async)
+{
+    // Give the data to the waiter the wake policy picks, the oldest by default; return false if nobody is waiting.
+    // The caller holds the queue's mtx. An async waiter is returned through *async, its callback must run after the mtx is released
+    waiter* wt;
+    wait_link* l;
+    *async = NULL;
+    while((l = wake_pick(q)) != NULL)
+    {
+        wt = l->owner;
+        if(wt->kind == WAIT_BATCH)
+        {
+            //collect in place, the sleeper is left alone until the batch reached its minimum
+            wt->batch[wt->got++] = data;
+            q->visited_cnt++;
+            if(wt->got >= wt->min)
+            {
+                wait_unlink(q, l);
+                wt->done = true;
+                cnd_signal(&wt->cnd);
+            }
+            return true;
+        }
+        wait_unlink(q, l);
+        if(wt->kind == WAIT_PLAIN)
+        {
+            //the item goes straight to the sleeper, it wakes up with it and counts the visit itself
+            wt->data = data;
+            wt->done = true;
+            cnd_signal(&wt->cnd);
+            return true;
+        }
+        if(wt->kind == WAIT_ASYNC)
+        {
+            //nobody will wake up to finish the dequeue, so account for it here
+            q->visited_cnt++;
+            q->mem_waiters -= sizeof(waiter);
+            wt->data = data;
+            *async = wt;
+            return true;
+        }
+        mtx_lock(&wt->mtx);
+        if(!wt->done)
+        {
+            //a dequeueAny waiter gets the item directly, it never enters the ready list
+            wt->done = true;
+            wt->data = data;
+            wt->from = q;
+            q->visited_cnt++;
+            cnd_signal(&wt->cnd);
+            mtx_unlock(&wt->mtx);
+            return true;
+        }
+        //already served by another queue, dropping its registration here is all that was left to do
+        mtx_unlock(&wt->mtx);
+    }
+    return false;
+}
+
+void make_ready(queue_t* q, void* data, size_t bytes)
+{
+    // Nobody is waiting, queue the data for the next dequeue. The caller holds the queue's mtx
+    if(spill_needed(q))
+    {
+        //memory is at the high-water mark, keep the order by appending behind the spilled items
+        spill_append(q, data);
+        return;
+    }
+    chunk_append(q, data, bytes);
+    q->mem_payload += bytes;
+}
+
+waiter* enqueue_locked(queue_t* q, void* data, size_t id, size_t bytes)
+{
+    // Hand the data to a waiter, otherwise queue it in its flow (fair mode) or in the FIFO.
+    // The caller holds the queue's mtx, and must run the returned async waiter (if any) after releasing it
+    waiter* async;
+    q->enqueued_cnt++;
+    if(hand_to_waiter(q, data, &async))
+    {
+        q->handoffs++;
+    }
+    else
+    {
+        if(q->flows != NULL)
+        {
+            fair_append(q, data, id, bytes);
+        }
+        else
+        {
+            make_ready(q, data, bytes);
+        }
+    }
+    return async;
+}
+
+void run_async(waiter* async)
+{
+    // Run a continuation that was handed an item, outside the lock so it may use the queue itself
+    async->callback(async->data, async->ctx);
+    free(async);
+}
+
+void combine_release_id(void* v)
+{
+    // Thread exit: give the combine id back so another thread can use the slot
+    if(v == COMBINE_NO_SLOT)
+    {
+        return;
+    }
+    mtx_lock(&combine_ids_mtx);
+    combine_free_ids[combine_free_cnt++] = (int) ((intptr_t) v - 1);
+    mtx_unlock(&combine_ids_mtx);
+}
+
+void combine_init(void)
+{
+    // One time setup of the combine id allocator
+    mtx_init(&combine_ids_mtx, mtx_plain);
+    tss_create(&combine_key, combine_release_id);
+    combine_free_cnt = 0;
+    combine_ids_hi = 0;
+}
+
+int combine_id(void)
+{
+    // Return the calling thread's slot index, allocated on first use, or -1 if all slots are taken
+    void* v;
+    int id = -1;
+    call_once(&combine_once, combine_init);
+    v = tss_get(combine_key);
+    if(v == COMBINE_NO_SLOT)
+    {
+        return -1;
+    }
+    if(v != NULL)
+    {
+        return (int) ((intptr_t) v - 1);
+    }
+    mtx_lock(&combine_ids_mtx);
+    if(combine_free_cnt > 0)
+    {
+        id = combine_free_ids[--combine_free_cnt];
+    }
+    else if(combine_ids_hi < COMBINE_SLOTS)
+    {
+        id = combine_ids_hi++;
+    }
+    mtx_unlock(&combine_ids_mtx);
+    tss_set(combine_key, id < 0 ? COMBINE_NO_SLOT : (void*) (intptr_t) (id + 1));
+    return id;
+}
+
+size_t combine(queue_t* q, waiter** asyncs)
+{
+    // Apply every published operation in one pass, the caller holds the queue's mtx.
+    // Async waiters handed an item are stored in asyncs, the caller runs them after unlocking; returns how many
+    int hi = combine_ids_hi;
+    int e = 0;
+    int d = 0;
+    size_t n = 0;
+    combine_slot* s;
+    if(!has_ready(q) && q->wait_head == NULL)
+    {
+        //nothing is queued and nobody waits: pairing an enqueue with a try-dequeue is the same as running them
+        //back to back, so the item goes straight across without ever touching the lists
+        while(true)
+        {
+            while(e < hi && !(q->slots[e].state == SLOT_PENDING && q->slots[e].op == OP_ENQUEUE))
+            {
+                e++;
+            }
+            while(d < hi && !(q->slots[d].state == SLOT_PENDING && q->slots[d].op == OP_TRY_DEQUEUE))
+            {
+                d++;
+            }
+            if(e == hi || d == hi)
+            {
+                break;
+            }
+            q->enqueued_cnt++;
+            q->visited_cnt++;
+            q->handoffs++;
+            q->slots[d].data = q->slots[e].data;
+            q->slots[d].ok = true;
+            q->slots[d].state = SLOT_DONE;
+            q->slots[e].state = SLOT_DONE;
+        }
+    }
+    //enqueues first, so the try-dequeues of the same pass can see their items
+    for(int i = 0; i < hi; i++)
+    {
+        s = &q->slots[i];
+        if(s->state == SLOT_PENDING && s->op == OP_ENQUEUE)
+        {
+            if((asyncs[n] = enqueue_locked(q, s->data, s->id, s->bytes)) != NULL)
+            {
+                n++;
+            }
+            s->state = SLOT_DONE;
+        }
+    }
+    for(int i = 0; i < hi; i++)
+    {
+        s = &q->slots[i];
+        if(s->state == SLOT_PENDING && s->op == OP_TRY_DEQUEUE)
+        {
+            s->ok = has_ready(q);
+            if(s->ok)
+            {
+                s->data = take_ready(q);
+            }
+            s->state = SLOT_DONE;
+        }
+    }
+    return n;
+}
+
+combine_slot* combine_publish(queue_t* q, slot_op op, void* data, size_t id, size_t bytes)
+{
+    // Publish an operation in the thread's slot and wait until some combiner, maybe this thread, applied it.
+    // Returns NULL if the thread has no slot; the caller then takes the lock itself
+    int me = combine_id();
+    combine_slot* s;
+    waiter* asyncs[COMBINE_SLOTS];
+    size_t n;
+    if(me < 0)
+    {
+        return NULL;
+    }
+    s = &q->slots[me];
+    s->op = op;
+    s->data = data;
+    s->id = id;
+    s->bytes = bytes;
+    s->state = SLOT_PENDING;
+    while(s->state != SLOT_DONE)
+    {
+        if(mtx_trylock(&q->mtx) == thrd_success)
+        {
+            n = combine(q, asyncs);
+            mtx_unlock(&q->mtx);
+            for(size_t i = 0; i < n; i++)
+            {
+                run_async(asyncs[i]);
+            }
+        }
+        else
+        {
+            thrd_yield();
+        }
+    }
+    s->state = SLOT_EMPTY;
+    return s;
+}
+
+size_t mem_used(queue_t* q)
+{
+    // Bytes the queue holds in memory right now, the caller holds the queue's mtx
+    size_t structure = sizeof(queue_t) + q->nflows * (sizeof(flow) + sizeof(queue)) +
+                       (q->timers != NULL ? sizeof(timer_wheel) : 0);
+    return structure + q->mem_nodes + q->mem_waiters + q->mem_payload;
+}
+
+bool mem_admit(queue_t* q, size_t bytes, bool may_reject)
+{
+    // Apply the memory limits to an item about to be enqueued, the caller holds the queue's mtx.
+    // Blocks while the item would pass the soft limit, returns false if it would pass the hard limit and may be rejected
+    size_t cost = bytes + (q->flows != NULL ? sizeof(node) : sizeof(void*));
+    size_t soft;
+    size_t hard;
+    //a waiter takes the item right away and an empty queue always accepts one, so neither can be over a limit
+    while(q->wait_head == NULL && has_ready(q))
+    {
+        soft = q->mem_soft;
+        hard = q->mem_hard;
+        if(hard > 0 && mem_used(q) + cost > hard)
+        {
+            if(may_reject)
+            {
+                return false;
+            }
+            //a plain enqueue cannot report failure, it waits for room like at the soft limit
+        }
+        else if(soft == 0 || mem_used(q) + cost <= soft)
+        {
+            return true;
+        }
+        q->space_waiters++;
+        cnd_wait(&q->space_cnd, &q->mtx);
+        q->space_waiters--;
+    }
+    return true;
+}
+
+bool spill_admit(queue_t* q, bool may_reject)
+{
+    // Reserve a disk slot for an item about to be enqueued, the caller holds the queue's mtx. If the disk tier
+    // cannot grow the item is rejected when it may be, otherwise the producer waits until consumers drain the tier
+    while(!spill_reserve(q))
+    {
+        if(may_reject)
+        {
+            return false;
+        }
+        q->space_waiters++;
+        cnd_wait(&q->space_cnd, &q->mtx);
+        q->space_waiters--;
+    }
+    return true;
+}
+
+bool enqueue_flow(queue_t* q, void* data, size_t id, size_t bytes, bool may_reject)
+{
+    // Hand the data to the oldest waiter, otherwise queue it in its flow (fair mode) or in the FIFO.
+    // With memory limits or spilling set the combining front end is bypassed, both are checked under the lock
+    waiter* async;
+    bool limited = q->mem_soft > 0 || q->mem_hard > 0;
+    if(!limited && q->spill_dir == NULL && q->combining && combine_publish(q, OP_ENQUEUE, data, id, bytes) != NULL)
+    {
+        return true;
+    }
+    mtx_lock(&q->mtx);
+    if((limited && !mem_admit(q, bytes, may_reject)) || !spill_admit(q, may_reject))
+    {
+        mtx_unlock(&q->mtx);
+        return false;
+    }
+    async = enqueue_locked(q, data, id, bytes);
+    mtx_unlock(&q->mtx);
+    if(async != NULL)
+    {
+        run_async(async);
+    }
+    return true;
+}
+
+void timer_insert(timer_wheel* w, timer_entry* e)
+{
+    // Place an item due after w->now in the lowest level whose span covers it: level l holds items due
+    // in [64^l, 64^(l+1)) ticks and is cascaded into the levels below when its slot comes up
+    uint64_t at = e->due;
+    int l = 0;
+    timer_slot* s;
+    if((at - w->now) >> (TIMER_BITS * TIMER_LEVELS) != 0)
+    {
+        //beyond the wheel, park it in the farthest top-level slot; it is re-placed when that slot cascades
+        at = w->now + ((uint64_t) 1 << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    }
+    while(l < TIMER_LEVELS - 1 && (at - w->now) >> (TIMER_BITS * (l + 1)) != 0)
+    {
+        l++;
+    }
+    s = &w->slots[l][(at >> (TIMER_BITS * l)) & (TIMER_SLOTS - 1)];
+    e->next = NULL;
+    if(s->tail == NULL)
+    {
+        s->head = e;
+    }
+    else
+    {
+        s->tail->next = e;
+    }
+    s->tail = e;
+}
+
+uint64_t timer_next(timer_wheel* w)
+{
+    // Return the next tick with work to do, a delivery on level 0 or a cascade above it, UINT64_MAX if none.
+    // At most TIMER_SLOTS slots per level are looked at, so this is bounded no matter how many items are pending
+    uint64_t next = UINT64_MAX;
+    uint64_t base;
+    if(w->cnt == 0)
+    {
+        return next;
+    }
+    for(int l = 0; l < TIMER_LEVELS; l++)
+    {
+        base = w->now >> (TIMER_BITS * l);
+        for(uint64_t k = 1; k <= TIMER_SLOTS; k++)
+        {
+            if(w->slots[l][(base + k) & (TIMER_SLOTS - 1)].head != NULL)
+            {
+                if((base + k) << (TIMER_BITS * l) < next)
+                {
+                    next = (base + k) << (TIMER_BITS * l);
+                }
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+void timer_tick(timer_wheel* w, uint64_t t, timer_slot* due)
+{
+    // Advance the wheel to tick t: cascade the higher-level slots that come up, then move level 0's slot to due
+    timer_slot* s;
+    timer_entry* e;
+    w->now = t;
+    for(int l = TIMER_LEVELS - 1; l > 0; l--)
+    {
+        if((t & (((uint64_t) 1 << (TIMER_BITS * l)) - 1)) != 0)
+        {
+            continue;
+        }
+        s = &w->slots[l][(t >> (TIMER_BITS * l)) & (TIMER_SLOTS - 1)];
+        e = s->head;
+        s->head = s->tail = NULL;
+        //each item moves at least one level down, one due on t itself lands in level 0's slot handled below
+        while(e != NULL)
+        {
+            timer_entry* next = e->next;
+            timer_insert(w, e);
+            e = next;
+        }
+    }
+    s = &w->slots[0][t & (TIMER_SLOTS - 1)];
+    if(s->head != NULL)
+    {
+        if(due->tail == NULL)
+        {
+            due->head = s->head;
+        }
+        else
+        {
+            due->tail->next = s->head;
+        }
+        due->tail = s->tail;
+        s->head = s->tail = NULL;
+    }
+}
+
+int timer_main(void* arg)
+{
+    // The queue's timer thread: sleep until the next tick with work, then enqueue every due item in one lock hold
+    queue_t* q = arg;
+    timer_wheel* w = q->timers;
+    timer_slot due;
+    timer_entry* e;
+    waiter** asyncs = NULL;
+    size_t nasync;
+    size_t cap = 0;
+    uint64_t now;
+    uint64_t next;
+    uint64_t wake_ns;
+    struct timespec deadline;
+    mtx_lock(&q->mtx);
+    while(!w->stop)
+    {
+        now = clock_ns() / 1000000 - w->base_ms;
+        due.head = due.tail = NULL;
+        while((next = timer_next(w)) <= now)
+        {
+            timer_tick(w, next, &due);
+        }
+        //nothing happens between the last event and now, so the wheel can jump there
+        if(now > w->now)
+        {
+            w->now = now;
+        }
+        nasync = 0;
+        while((e = due.head) != NULL)
+        {
+            due.head = e->next;
+            w->cnt--;
+            q->mem_nodes -= sizeof(timer_entry);
+            if(nasync == cap)
+            {
+                cap = cap > 0 ? 2 * cap : 16;
+                asyncs = realloc(asyncs, cap * sizeof(waiter*));
+            }
+            if((asyncs[nasync] = enqueue_locked(q, e->data, 0, 0)) != NULL)
+            {
+                nasync++;
+            }
+            free(e);
+        }
+        if(nasync > 0)
+        {
+            mtx_unlock(&q->mtx);
+            for(size_t i = 0; i < nasync; i++)
+            {
+                run_async(asyncs[i]);
+            }
+            mtx_lock(&q->mtx);
+            continue;
+        }
+        w->wake = timer_next(w);
+        if(w->wake == UINT64_MAX)
+        {
+            cnd_wait(&w->cnd, &q->mtx);
+        }
+        else
+        {
+            //ticks are monotonic, only the remaining time goes through the wall clock; if that is set meanwhile
+            //the wait ends early or late, never the ticks
+            wake_ns = (w->base_ms + w->wake) * 1000000;
+            now = clock_ns();
+            deadline = deadline_after(wake_ns > now ? wake_ns - now : 0);
+            cnd_timedwait(&w->cnd, &q->mtx, &deadline);
+        }
+    }
+    mtx_unlock(&q->mtx);
+    free(asyncs);
+    return 0;
+}
+
+void enqueue_after(queue_t* q, void* data, const struct timespec* delay)
+{
+    // Enqueue the data once delay has passed, rounded up to whole milliseconds. Until then it is not part of the
+    // queue's size; the timer thread is started with the first delayed item
+    uint64_t ticks = (uint64_t) delay->tv_sec * 1000 + ((uint64_t) delay->tv_nsec + 999999) / 1000000;
+    timer_wheel* w;
+    timer_entry* e;
+    if(ticks == 0)
+    {
+        enqueue_flow(q, data, 0, 0, false);
+        return;
+    }
+    mtx_lock(&q->mtx);
+    if(q->timers == NULL)
+    {
+        w = calloc(1, sizeof(timer_wheel));
+        w->base_ms = clock_ns() / 1000000;
+        w->wake = UINT64_MAX;
+        cnd_init(&w->cnd);
+        q->timers = w;
+        thrd_create(&w->thread, timer_main, q);
+    }
+    w = q->timers;
+    e = malloc(sizeof(timer_entry));
+    e->data = data;
+    //part of the current tick has passed already, one more keeps the delay a lower bound
+    e->due = clock_ns() / 1000000 - w->base_ms + ticks + 1;
+    timer_insert(w, e);
+    w->cnt++;
+    q->mem_nodes += sizeof(timer_entry);
+    if(e->due < w->wake)
+    {
+        //due before the timer thread means to wake up
+        cnd_signal(&w->cnd);
+    }
+    mtx_unlock(&q->mtx);
+}
+
+void stats_wait(queue_t* q, uint64_t start)
+{
+    // Count a blocking dequeue that slept since start in the log2 histogram of wait times
+    uint64_t us = clock_ns() / 1000 - start;
+    size_t b = 0;
+    while(us > 1 && b < QUEUE_STATS_BUCKETS - 1)
+    {
+        us >>= 1;
+        b++;
+    }
+    q->wait_hist[b]++;
+}
+
+void stats_write(stats_export* x)
+{
+    // Copy the counters into the page under its seqlock. The export thread is the only writer: seq goes odd,
+    // the fields are stored, seq goes even again, and a reader that saw the same even seq before and after has a consistent copy
+    queue_t* q = x->q;
+    queue_stats_page* page = x->page;
+    uint64_t seq = atomic_load_explicit(&page->seq, memory_order_relaxed);
+    size_t v = q->visited_cnt; //loaded first like in queueSize, so depth never underflows
+    size_t e = q->enqueued_cnt;
+    atomic_store_explicit(&page->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&page->updated_us, clock_ns() / 1000, memory_order_relaxed);
+    atomic_store_explicit(&page->depth, e - v, memory_order_relaxed);
+    atomic_store_explicit(&page->waiting, (uint64_t) q->waiting_cnt, memory_order_relaxed);
+    atomic_store_explicit(&page->enqueued, e, memory_order_relaxed);
+    atomic_store_explicit(&page->dequeued, v, memory_order_relaxed);
+    atomic_store_explicit(&page->handoffs, q->handoffs, memory_order_relaxed);
+    for(size_t i = 0; i < QUEUE_STATS_BUCKETS; i++)
+    {
+        atomic_store_explicit(&page->wait_us[i], q->wait_hist[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&page->seq, seq + 2, memory_order_release);
+}
+
+int stats_main(void* arg)
+{
+    // The export thread: refresh the page every period from the queue's atomic counters, never taking the queue's mtx
+    stats_export* x = arg;
+    struct timespec deadline;
+    mtx_lock(&x->mtx);
+    while(!x->stop)
+    {
+        stats_write(x);
+        deadline = deadline_after((uint64_t) x->period_ms * 1000000);
+        cnd_timedwait(&x->cnd, &x->mtx, &deadline);
+    }
+    mtx_unlock(&x->mtx);
+    //readers that still have the page mapped see the final values
+    stats_write(x);
+    return 0;
+}
+
+void stage_flush(stage* st)
+{
+    // Publish the staged items in one lock hold, in the order they were staged. They leave the buffer before the
+    // memory limits are applied, so a producer blocked at a limit never holds the buffer's mtx
+    queue_t* q = st->q;
+    void* items[STAGE_ITEMS];
+    waiter* asyncs[STAGE_ITEMS];
+    size_t n = 0;
+    size_t staged;
+    bool limited;
+    if(q == NULL)
+    {
+        return;
+    }
+    limited = q->mem_soft > 0 || q->mem_hard > 0;
+    mtx_lock(&q->mtx);
+    mtx_lock(&st->mtx);
+    staged = st->n;
+    memcpy(items, st->items, staged * sizeof(void*));
+    st->n = 0;
+    mtx_unlock(&st->mtx);
+    for(size_t i = 0; i < staged; i++)
+    {
+        if(limited)
+        {
+            mem_admit(q, 0, false);
+        }
+        if((asyncs[n] = enqueue_locked(q, items[i], 0, 0)) != NULL)
+        {
+            n++;
+        }
+    }
+    mtx_unlock(&q->mtx);
+    for(size_t i = 0; i < n; i++)
+    {
+        run_async(asyncs[i]);
+    }
+}
+
+void stage_unbind(stage* st)
+{
+    // Publish what is staged and take the buffer out of its queue's registry
+    queue_t* q = st->q;
+    if(q == NULL)
+    {
+        return;
+    }
+    stage_flush(st);
+    mtx_lock(&q->mtx);
+    if(st->prev == NULL)
+    {
+        q->stages = st->next;
+    }
+    else
+    {
+        st->prev->next = st->next;
+    }
+    if(st->next != NULL)
+    {
+        st->next->prev = st->prev;
+    }
+    st->prev = st->next = NULL;
+    st->q = NULL;
+    mtx_unlock(&q->mtx);
+}
+
+void stage_bind(stage* st, queue_t* q)
+{
+    // Register the empty buffer with q, so consumers of q can reach the items staged in it
+    mtx_lock(&q->mtx);
+    st->prev = NULL;
+    st->next = q->stages;
+    if(q->stages != NULL)
+    {
+        q->stages->prev = st;
+    }
+    q->stages = st;
+    st->q = q;
+    mtx_unlock(&q->mtx);
+}
+
+wait_link* stage_collect(queue_t* q)
+{
+    // Publish the items producers left in their staging buffers. A consumer calls this after registering its waiter,
+    // so a producer that staged an item and went idle cannot keep it waiting. The caller holds the queue's mtx;
+    // the async waiters that got an item are returned chained through link.next, to run once the mtx is released
+    wait_link* head = NULL;
+    wait_link** tail = &head;
+    waiter* async;
+    for(stage* st = q->stages; st != NULL; st = st->next)
+    {
+        mtx_lock(&st->mtx);
+        for(size_t i = 0; i < st->n; i++)
+        {
+            if((async = enqueue_locked(q, st->items[i], 0, 0)) != NULL)
+            {
+                async->link.next = NULL;
+                *tail = &async->link;
+                tail = &async->link.next;
+            }
+        }
+        st->n = 0;
+        mtx_unlock(&st->mtx);
+    }
+    return head;
+}
+
+void run_asyncs(wait_link* l)
+{
+    // Run the continuations returned by stage_collect, in the order they were served
+    wait_link* next;
+    while(l != NULL)
+    {
+        next = l->next;
+        run_async(l->owner);
+        l = next;
+    }
+}
+
+void stage_exit(void* v)
+{
+    // Thread exit: items still staged are published, not lost, unless their queue was destroyed first
+    stage* st = v;
+    stage_unbind(st);
+    mtx_destroy(&st->mtx);
+    free(st);
+}
+
+void stage_init(void)
+{
+    // One time setup of the staging buffers' key
+    tss_create(&stage_key, stage_exit);
+}
+
+void enqueue_buffered(queue_t* q, void* data)
+{
+    // Stage the item in the calling thread's buffer. The buffer is published when it is full, before items for
+    // another queue are staged, and right away whenever a consumer is waiting. A consumer that goes to sleep
+    // publishes the staged items itself, so sleepers are never kept waiting for the producer's next call
+    stage* st;
+    bool full;
+    call_once(&stage_once, stage_init);
+    st = tss_get(stage_key);
+    if(st == NULL)
+    {
+        st = malloc(sizeof(stage));
+        st->q = NULL;
+        mtx_init(&st->mtx, mtx_plain);
+        st->n = 0;
+        st->prev = st->next = NULL;
+        tss_set(stage_key, st);
+    }
+    if(st->q != q)
+    {
+        stage_unbind(st);
+        stage_bind(st, q);
+    }
+    mtx_lock(&st->mtx);
+    st->items[st->n++] = data;
+    full = st->n == STAGE_ITEMS;
+    mtx_unlock(&st->mtx);
+    //checked after the item is visible to consumers: they register before collecting, so one side sees the other
+    if(full || q->waiting_cnt > 0)
+    {
+        stage_flush(st);
+    }
+}
+
+bool dequeue_async(queue_t* q, dequeue_callback callback, void* ctx)
+{
+    // Call callback(item, ctx) with the next item. If one is ready it runs right away in the caller and true is returned,
+    // otherwise the continuation takes a place in the same FIFO waiter list as blocking dequeues and false is returned
+    waiter* wt;
+    wait_link* asyncs;
+    void* data;
+    mtx_lock(&q->mtx);
+    if(has_ready(q))
+    {
+        data = take_ready(q);
+        mtx_unlock(&q->mtx);
+        callback(data, ctx);
+        return true;
+    }
+    wt = malloc(sizeof(waiter));
+    q->mem_waiters += sizeof(waiter);
+    wt->kind = WAIT_ASYNC;
+    wt->hint = -1;
+    wt->callback = callback;
+    wt->ctx = ctx;
+    wait_push(q, &wt->link, wt);
+    asyncs = q->stages != NULL ? stage_collect(q) : NULL;
+    mtx_unlock(&q->mtx);
+    //a staged item may have gone to this continuation already
+    run_asyncs(asyncs);
+    return false;
+}
+
+void enqueue_to(queue_t* q, void* data)
+{
+    // Hand the data to the oldest waiter, or make it ready if nobody is waiting. In fair mode it goes to flow 0
+    enqueue_flow(q, data, 0, 0, false);
+}
+
+void* dequeue_from(queue_t* q)
+{
+    // Remove and return an item from the queue, sleeping in FIFO order among waiters if none is ready
+    mtx_lock(&q->mtx);
+    void* data;
+    if(!has_ready(q))
+    {
+        //there is no item ready to dequeue, the waiter record lives on this stack for as long as we sleep
+        waiter w;
+        wait_link* asyncs = NULL;
+        bool timed = q->stats != NULL;
+        uint64_t start = timed ? clock_ns() / 1000 : 0;
+        w.kind = WAIT_PLAIN;
+        w.hint = q->wake == WAKE_AFFINITY ? wake_hint() : -1;
+        w.done = false;
+        cnd_init(&w.cnd);
+        wait_push(q, &w.link, &w);
+        if(q->stages != NULL)
+        {
+            asyncs = stage_collect(q);
+        }
+        while(!w.done)
+        {
+            cnd_wait(&w.cnd, &q->mtx);
+        }
+        //now i have an item to dequeue
+        data = w.data;
+        cnd_destroy(&w.cnd);
+        q->visited_cnt++;
+        if(timed)
+        {
+            stats_wait(q, start);
+        }
+        mtx_unlock(&q->mtx);
+        run_asyncs(asyncs);
+        return data;
+    }
+    else
+    {
+        //there is an item ready to dequeue
+        data = take_ready(q);
+        mtx_unlock(&q->mtx);
+        return data;
+    }
+}
+
+bool try_dequeue_from(queue_t* q, void** point)
+{
+    // Take the oldest ready item without blocking
+    combine_slot* s;
+    if(q->combining && (s = combine_publish(q, OP_TRY_DEQUEUE, NULL, 0, 0)) != NULL)
+    {
+        //the slot stays ours until our next operation, so its result can still be read
+        if(s->ok)
+        {
+            *point = s->data;
+        }
+        return s->ok;
+    }
+    mtx_lock(&q->mtx);
+    if(!has_ready(q))
+    {
+        mtx_unlock(&q->mtx);
+        return false;
+    }
+    *point = take_ready(q);
+    mtx_unlock(&q->mtx);
+    return true;
+}
+
+size_t dequeue_batch(queue_t* q, void** out, size_t min, size_t max, const struct timespec* linger)
+{
+    // Take the ready items up to max; if fewer than min, sleep in the waiter list while enqueues hand items over,
+    // woken once when min are in or when linger has passed. Returns the number of items stored in out
+    waiter w;
+    wait_link* asyncs = NULL;
+    struct timespec deadline;
+    size_t n = 0;
+    if(min > max)
+    {
+        min = max;
+    }
+    mtx_lock(&q->mtx);
+    while(n < max && has_ready(q))
+    {
+        out[n++] = take_ready(q);
+    }
+    if(n >= min)
+    {
+        mtx_unlock(&q->mtx);
+        return n;
+    }
+    if(linger != NULL)
+    {
+        deadline = deadline_after((uint64_t) linger->tv_sec * 1000000000ULL + (uint64_t) linger->tv_nsec);
+    }
+    w.kind = WAIT_BATCH;
+    w.hint = q->wake == WAKE_AFFINITY ? wake_hint() : -1;
+    w.done = false;
+    w.batch = out;
+    w.got = n;
+    w.min = min;
+    cnd_init(&w.cnd);
+    wait_push(q, &w.link, &w);
+    if(q->stages != NULL)
+    {
+        asyncs = stage_collect(q);
+    }
+    while(!w.done)
+    {
+        if(linger == NULL)
+        {
+            cnd_wait(&w.cnd, &q->mtx);
+        }
+        else if(cnd_timedwait(&w.cnd, &q->mtx, &deadline) == thrd_timedout)
+        {
+            break;
+        }
+    }
+    if(!w.done)
+    {
+        //lingered long enough, leave with what was collected
+        wait_unlink(q, &w.link);
+    }
+    n = w.got;
+    //items that arrived while waking up are ready now, take them in the same lock hold
+    while(n < max && has_ready(q))
+    {
+        out[n++] = take_ready(q);
+    }
+    mtx_unlock(&q->mtx);
+    cnd_destroy(&w.cnd);
+    run_asyncs(asyncs);
+    return n;
+}
+
+size_t snapshot_from(queue_t* q, void** out, size_t max)
+{
+    // Copy up to max ready items in the order they would be dequeued, without claiming them.
+    // Items already handed to a sleeping waiter are skipped and spilled items are not visited. In fair mode the
+    // deficit round-robin is replayed on copies of the flows' cursors, deficits and ring links
+    typedef struct flow_view
+    {
+        node* cur;
+        size_t deficit;
+        flow* next;
+    } flow_view;
+    size_t n = 0;
+    chunk* c;
+    flow_view* views;
+    flow* tail;
+    flow* f;
+    mtx_lock(&q->mtx);
+    for(c = q->ready.head; c != NULL && n < max; c = c->next)
+    {
+        for(size_t i = c->head; i < c->tail && n < max; i++)
+        {
+            out[n++] = c->items[i];
+        }
+    }
+    if(n < max && q->ring_tail != NULL)
+    {
+        views = malloc(q->nflows * sizeof(flow_view));
+        for(size_t i = 0; i < q->nflows; i++)
+        {
+            views[i].cur = q->flows[i].items->head;
+            views[i].deficit = q->flows[i].deficit;
+            views[i].next = q->flows[i].next;
+        }
+        tail = q->ring_tail;
+        while(n < max && tail != NULL)
+        {
+            //the same steps as fair_take
+            f = views[tail - q->flows].next;
+            flow_view* v = &views[f - q->flows];
+            if(v->deficit == 0)
+            {
+                v->deficit = f->weight;
+            }
+            out[n++] = v->cur->data;
+            v->cur = v->cur->next;
+            v->deficit--;
+            if(v->cur == NULL)
+            {
+                views[tail - q->flows].next = v->next;
+                tail = v->next == f ? NULL : tail;
+            }
+            else if(v->deficit == 0)
+            {
+                tail = f;
+            }
+        }
+        free(views);
+    }
+    mtx_unlock(&q->mtx);
+    return n;
+}
+
+void list_initQueue(void)
+{
+    // Initialize the default queue of the list backend
+    init_queue(&main_q);
+}
+
+void list_destroyQueue(void)
+{
+    // Clean up the default queue of the list backend
+    destroy_queue(&main_q);
+}
+
+void list_enqueue(void* data)
+{
+    // Add the data to the default queue
+    enqueue_to(&main_q, data);
+}
+
+void* list_dequeue(void)
+{
+    // Remove an item from the default queue, block if it is empty
+    return dequeue_from(&main_q);
+}
+
+bool list_tryDequeue(void** point)
+{
+    // Try to remove an item from the default queue without blocking
+    return try_dequeue_from(&main_q, point);
+}
+
+size_t list_size(void)
+{
+    // Return the size of the default queue
+    return queueSize(&main_q);
+}
+
+size_t list_waiting(void)
+{
+    // Return the number of threads waiting on the default queue
+    return queueWaiting(&main_q);
+}
+
+size_t list_visited(void)
+{
+    // Return the number of items dequeued from the default queue
+    return queueVisited(&main_q);
+}
+
+const queue_backend list_backend = {
+    "list",
+    list_initQueue,
+    list_destroyQueue,
+    list_enqueue,
+    list_dequeue,
+    list_tryDequeue,
+    list_size,
+    list_waiting,
+    list_visited,
+};
+
+void combining_initQueue(void)
+{
+    // Initialize the default queue with the flat-combining front end switched on
+    init_queue(&main_q);
+    main_q.combining = true;
+}
+
+const queue_backend combining_backend = {
+    "combining",
+    combining_initQueue,
+    list_destroyQueue,
+    list_enqueue,
+    list_dequeue,
+    list_tryDequeue,
+    list_size,
+    list_waiting,
+    list_visited,
+};
+
+const queue_backend* backends[QUEUE_MAX_BACKENDS] = {&list_backend, &combining_backend};
+size_t backends_cnt = 2;
+
+bool registerBackend(const queue_backend* b)
+{
+    // Make another implementation selectable by name, must be called before the queue is in use
+    if(backends_cnt == QUEUE_MAX_BACKENDS)
+    {
+        return false;
+    }
+    backends[backends_cnt++] = b;
+    return true;
+}
+
+bool selectBackend(const char* name)
+{
+    // Pick the implementation behind initQueue/enqueue/dequeue/..., while no queue is initialized.
+    // NULL means the QUEUE_BACKEND environment variable, or "list" if it is not set.
+    if(name == NULL)
+    {
+        name = getenv("QUEUE_BACKEND");
+    }
+    if(name == NULL)
+    {
+        name = list_backend.name;
+    }
+    for(size_t i = 0; i < backends_cnt; i++)
+    {
+        if(strcmp(backends[i]->name, name) == 0)
+        {
+            active_backend = backends[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t listBackends(const queue_backend** out, size_t max)
+{
+    // Copy up to max registered backends into out, return how many were copied
+    size_t n;
+    for(n = 0; n < backends_cnt && n < max; n++)
+    {
+        out[n] = backends[n];
+    }
+    return n;
+}
+
+const queue_backend* currentBackend(void)
+{
+    // Return the backend the queue API dispatches to
+    return active_backend;
+}
+
+typedef enum trace_op
+{
+    TRACE_ENQUEUE,
+    TRACE_DEQUEUE,
+    TRACE_TRY_DEQUEUE,
+} trace_op;
+
+#define TRACE_OK 0x100 // set in trace_rec.op when the call moved an item: always for enqueue and dequeue, for tryDequeue if it got one
+#define TRACE_NO_THREAD UINT32_MAX // trace_buf.thread of a buffer that has not recorded since startRecording
+
+typedef struct trace_rec
+{
+    uint64_t start_ns; // call time, since startRecording
+    uint64_t end_ns; // return time
+    uint32_t thread; // small id given to each recording thread in order of appearance
+    uint32_t op; // trace_op, plus TRACE_OK
+} trace_rec;
+
+typedef struct trace_buf
+{
+    mtx_t mtx; // uncontended for its thread, taken by stopRecording to drain the buffer
+    uint32_t thread; // id in the current recording, changed under trace_mtx and mtx
+    size_t n;
+    trace_rec recs[TRACE_RING_RECS];
+    struct trace_buf* prev; // every live buffer, so stopRecording can drain them all
+    struct trace_buf* next;
+} trace_buf;
+
+once_flag trace_once = ONCE_FLAG_INIT;
+tss_t trace_key; // the thread's trace_buf
+mtx_t trace_mtx; // guards the buffer list and thread ids, taken before a buffer's mtx
+mtx_t trace_file_mtx; // guards trace_file, taken after a buffer's mtx
+FILE* trace_file;
+atomic_bool recording;
+uint64_t trace_epoch;
+trace_buf* trace_bufs;
+uint32_t trace_threads;
+
+void trace_write(trace_buf* b)
+{
+    // Append the buffered records to the trace file and empty the buffer, the caller holds b->mtx.
+    // Records taken after stopRecording are dropped
+    mtx_lock(&trace_file_mtx);
+    if(trace_file != NULL)
+    {
+        fwrite(b->recs, sizeof(trace_rec), b->n, trace_file);
+    }
+    mtx_unlock(&trace_file_mtx);
+    b->n = 0;
+}
+
+void trace_exit(void* v)
+{
+    // Thread exit: write out what the thread recorded and forget its buffer
+    trace_buf* b = v;
+    mtx_lock(&b->mtx);
+    trace_write(b);
+    mtx_unlock(&b->mtx);
+    mtx_lock(&trace_mtx);
+    if(b->prev == NULL)
+    {
+        trace_bufs = b->next;
+    }
+    else
+    {
+        b->prev->next = b->next;
+    }
+    if(b->next != NULL)
+    {
+        b->next->prev = b->prev;
+    }
+    mtx_unlock(&trace_mtx);
+    mtx_destroy(&b->mtx);
+    free(b);
+}
+
+void trace_init(void)
+{
+    // One time setup of the recorder
+    mtx_init(&trace_mtx, mtx_plain);
+    mtx_init(&trace_file_mtx, mtx_plain);
+    tss_create(&trace_key, trace_exit);
+}
+
+void trace_record(trace_op op, bool ok, uint64_t start)
+{
+    // Log one call of the calling thread into its buffer, writing the buffer out when it is full
+    trace_buf* b = tss_get(trace_key);
+    uint64_t end = clock_ns();
+    if(b == NULL)
+    {
+        b = malloc(sizeof(trace_buf));
+        mtx_init(&b->mtx, mtx_plain);
+        b->n = 0;
+        b->prev = NULL;
+        mtx_lock(&trace_mtx);
+        b->thread = trace_threads++;
+        b->next = trace_bufs;
+        if(trace_bufs != NULL)
+        {
+            trace_bufs->prev = b;
+        }
+        trace_bufs = b;
+        mtx_unlock(&trace_mtx);
+        tss_set(trace_key, b);
+    }
+    mtx_lock(&b->mtx);
+    if(b->thread == TRACE_NO_THREAD)
+    {
+        //first call since startRecording, ids are given in order of appearance within each recording
+        mtx_unlock(&b->mtx);
+        mtx_lock(&trace_mtx);
+        mtx_lock(&b->mtx);
+        if(b->thread == TRACE_NO_THREAD)
+        {
+            b->thread = trace_threads++;
+        }
+        mtx_unlock(&trace_mtx);
+    }
+    b->recs[b->n].start_ns = start - trace_epoch;
+    b->recs[b->n].end_ns = end - trace_epoch;
+    b->recs[b->n].thread = b->thread;
+    b->recs[b->n].op = op | (ok ? TRACE_OK : 0);
+    if(++b->n == TRACE_RING_RECS)
+    {
+        trace_write(b);
+    }
+    mtx_unlock(&b->mtx);
+}
+
+void trace_drain(void)
+{
+    // Write out every thread's buffer
+    trace_buf* b;
+    mtx_lock(&trace_mtx);
+    for(b = trace_bufs; b != NULL; b = b->next)
+    {
+        mtx_lock(&b->mtx);
+        trace_write(b);
+        mtx_unlock(&b->mtx);
+    }
+    mtx_unlock(&trace_mtx);
+}
+
+bool startRecording(const char* path)
+{
+    // Log every enqueue/dequeue/tryDequeue call with its thread and timestamps into the file at path, for replay.
+    // Each thread buffers its records and writes them out in blocks. Returns false if a recording is already running
+    FILE* f;
+    trace_buf* b;
+    call_once(&trace_once, trace_init);
+    mtx_lock(&trace_mtx);
+    mtx_lock(&trace_file_mtx);
+    if(trace_file != NULL || (f = fopen(path, "wb")) == NULL)
+    {
+        mtx_unlock(&trace_file_mtx);
+        mtx_unlock(&trace_mtx);
+        return false;
+    }
+    fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC) - 1, f);
+    trace_file = f;
+    trace_epoch = clock_ns();
+    mtx_unlock(&trace_file_mtx);
+    //thread ids restart at 0, buffers of threads from an earlier recording get one when they record again
+    trace_threads = 0;
+    for(b = trace_bufs; b != NULL; b = b->next)
+    {
+        mtx_lock(&b->mtx);
+        b->thread = TRACE_NO_THREAD;
+        b->n = 0;
+        mtx_unlock(&b->mtx);
+    }
+    mtx_unlock(&trace_mtx);
+    recording = true;
+    return true;
+}
+
+void stopRecording(void)
+{
+    // Stop logging, write out every thread's records and close the trace file
+    call_once(&trace_once, trace_init);
+    recording = false;
+    trace_drain();
+    mtx_lock(&trace_file_mtx);
+    if(trace_file != NULL)
+    {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    mtx_unlock(&trace_file_mtx);
+}
+
+size_t size(void)
+{
+    // Return the current size of the FIFO queue
+    return active_backend->size();
+}
+
+size_t waiting(void)
+{
+    // Return the number of threads waiting in the FIFO queue
+    return active_backend->waiting();
+}
+
+size_t visited()
+{
+    // Return the number of items dequeued from the FIFO queue
+    return active_backend->visited();
+}
+
+void initQueue(void)
+{
+    // Initialize the FIFO queue and other data structures, with the backend chosen by the environment if none was selected
+    if(active_backend == NULL && !selectBackend(NULL))
+    {
+        fprintf(stderr, "queue: unknown QUEUE_BACKEND \"%s\", using \"%s\"\n", getenv("QUEUE_BACKEND"), list_backend.name);
+        active_backend = &list_backend;
+    }
+    active_backend->initQueue();
+}
+
+void destroyQueue(void)
+{
+    // Clean up the memory and resources used by the FIFO queue
+    active_backend->destroyQueue();
+}
+
+void enqueue(void* data)
+{
+    // Add the data to the FIFO queue
+    uint64_t start;
+    if(!recording)
+    {
+        active_backend->enqueue(data);
+        return;
+    }
+    start = clock_ns();
+    active_backend->enqueue(data);
+    trace_record(TRACE_ENQUEUE, true, start);
+}
+
+void* dequeue()
+{
+    // Remove and return an item from the FIFO queue
+    uint64_t start;
+    void* data;
+    if(!recording)
+    {
+        return active_backend->dequeue();
+    }
+    start = clock_ns();
+    data = active_backend->dequeue();
+    trace_record(TRACE_DEQUEUE, true, start);
+    return data;
+}
+
+bool tryDequeue(void** point)
+{
+    // Try to remove and return an item from the FIFO queue, return false if the queue is empty, and true if an item was dequeued
+    uint64_t start;
+    bool ok;
+    if(!recording)
+    {
+        return active_backend->tryDequeue(point);
+    }
+    start = clock_ns();
+    ok = active_backend->tryDequeue(point);
+    trace_record(TRACE_TRY_DEQUEUE, ok, start);
+    return ok;
+}
+
+bool peek(void** point)
+{
+    // Return the item the next dequeue would get without removing it, false if no item is ready.
+    // Like the rest of the extended API below, it finds nothing unless the active backend is a list one
+    queue_t* q = list_queue();
+    return q != NULL && snapshot_from(q, point, 1) == 1;
+}
+
+size_t snapshot(void** out, size_t max)
+{
+    // Copy up to max of the next items to be dequeued into out, return how many were copied
+    queue_t* q = list_queue();
+    return q != NULL ? snapshot_from(q, out, max) : 0;
+}
+
+void enqueueFlow(void* data, size_t id)
+{
+    // Add the data to the given flow, in fair mode flows are served by weighted round-robin instead of one FIFO.
+    // Other backends have no flows and take it as a plain enqueue
+    queue_t* q = list_queue();
+    if(q == NULL)
+    {
+        active_backend->enqueue(data);
+        return;
+    }
+    enqueue_flow(q, data, id, 0, false);
+}
+
+bool dequeueAsync(void (*callback)(void*, void*), void* ctx)
+{
+    // Dequeue without blocking a thread: callback(item, ctx) runs now if an item is ready (returns true),
+    // or later in the enqueuing thread, in FIFO order with the blocked dequeues (returns false).
+    // Other backends cannot call back later: nothing is taken, the callback never runs and false is returned
+    queue_t* q = list_queue();
+    return q != NULL && dequeue_async(q, callback, ctx);
+}
+
+void enqueueBuffered(void* data)
+{
+    // Add the data through the calling thread's staging buffer; it is not visible to tryDequeue, size or peek until
+    // the buffer is published, at the latest by flushEnqueue or when the thread exits. A blocking dequeue that finds
+    // nothing ready publishes the staged items of every thread instead of sleeping past them.
+    // Other backends have no staging buffers and take it as a plain enqueue
+    queue_t* q = list_queue();
+    if(q == NULL)
+    {
+        active_backend->enqueue(data);
+        return;
+    }
+    enqueue_buffered(q, data);
+}
+
+void enqueueAfterTo(queue_t* q, void* data, const struct timespec* delay)
+{
+    // Add the data to the given queue once delay has passed, see enqueueAfter
+    enqueue_after(q, data, delay);
+}
+
+void enqueueBufferedTo(queue_t* q, void* data)
+{
+    // Add the data to the given queue through the calling thread's staging buffer, see enqueueBuffered
+    enqueue_buffered(q, data);
+}
+
+void flushEnqueue(void)
+{
+    // Publish the items the calling thread staged with enqueueBuffered
+    stage* st;
+    call_once(&stage_once, stage_init);
+    st = tss_get(stage_key);
+    if(st != NULL)
+    {
+        stage_flush(st);
+    }
+}
+
+bool enqueueAfter(void* data, const struct timespec* delay)
+{
+    // Add the data once delay (relative) has passed, without tying up the calling thread.
+    // Delayed items are kept in a hierarchical timer wheel served by one timer thread per queue.
+    // false, and nothing is enqueued, if the active backend is not a list one
+    queue_t* q = list_queue();
+    if(q == NULL)
+    {
+        return false;
+    }
+    enqueue_after(q, data, delay);
+    return true;
+}
+
+size_t dequeueBatch(void** out, size_t min, size_t max, const struct timespec* linger)
+{
+    // Block until at least min items were dequeued into out or linger (relative, NULL waits forever) has passed,
+    // then take the ready ones up to max. One wakeup per batch; returns how many items were stored, 0 right away
+    // if the active backend is not a list one
+    queue_t* q = list_queue();
+    return q != NULL ? dequeue_batch(q, out, min, max, linger) : 0;
+}
+
+queue_t* newQueue(void)
+{
+    // Create an independent queue, usable with the *To/*From functions and dequeueAny
+    //aligned so the combine slots really sit one per cache line; sizeof(queue_t) is a multiple of the alignment
+    queue_t* q = aligned_alloc(_Alignof(queue_t), sizeof(queue_t));
+    init_queue(q);
+    return q;
+}
+
+void freeQueue(queue_t* q)
+{
+    // Destroy a queue created by newQueue
+    destroy_queue(q);
+    free(q);
+}
+
+queue_t* defaultQueue(void)
+{
+    // Return the handle of the queue behind initQueue/enqueue/dequeue, so it can take part in dequeueAny.
+    // NULL if the active backend is not a list one, its queue has no handle
+    return list_queue();
+}
+
+void enqueueTo(queue_t* q, void* data)
+{
+    // Add the data to the given queue
+    enqueue_to(q, data);
+}
+
+void* dequeueFrom(queue_t* q)
+{
+    // Remove and return an item from the given queue, block if it is empty
+    return dequeue_from(q);
+}
+
+bool tryDequeueFrom(queue_t* q, void** point)
+{
+    // Try to remove an item from the given queue without blocking
+    return try_dequeue_from(q, point);
+}
+
+bool peekFrom(queue_t* q, void** point)
+{
+    // Return the next item of the given queue without removing it
+    return snapshot_from(q, point, 1) == 1;
+}
+
+size_t snapshotFrom(queue_t* q, void** out, size_t max)
+{
+    // Copy up to max of the next items of the given queue into out
+    return snapshot_from(q, out, max);
+}
+
+bool dequeueAsyncFrom(queue_t* q, void (*callback)(void*, void*), void* ctx)
+{
+    // Dequeue from the given queue without blocking a thread, see dequeueAsync
+    return dequeue_async(q, callback, ctx);
+}
+
+size_t dequeueBatchFrom(queue_t* q, void** out, size_t min, size_t max, const struct timespec* linger)
+{
+    // Dequeue a batch from the given queue, see dequeueBatch
+    return dequeue_batch(q, out, min, max, linger);
+}
+
+void setCombining(queue_t* q, bool on)
+{
+    // Route enqueue/tryDequeue of the given queue through per-thread slots applied in batches by whichever thread
+    // holds the lock. Blocking dequeue keeps taking the lock itself. Switch it while the queue is idle
+    q->combining = on;
+}
+
+bool enqueueSized(void* data, size_t bytes)
+{
+    // Add data whose payload takes bytes of memory, see enqueueSizedTo. false if the active backend is not a list one
+    queue_t* q = list_queue();
+    return q != NULL && enqueue_flow(q, data, 0, bytes, true);
+}
+
+bool enqueueSizedTo(queue_t* q, void* data, size_t bytes)
+{
+    // Add data whose payload takes bytes of memory to the given queue; the bytes count towards its memory usage
+    // until the item is dequeued. Returns false, without queueing it, if it would take the queue past its hard limit
+    return enqueue_flow(q, data, 0, bytes, true);
+}
+
+void setMemoryLimits(queue_t* q, size_t soft, size_t hard)
+{
+    // Bound the memory the queue holds, 0 disables a limit. Past soft every enqueue blocks until dequeues make room,
+    // past hard enqueueSized fails instead. A waiting consumer or an empty queue always takes the item
+    mtx_lock(&q->mtx);
+    q->mem_soft = soft;
+    q->mem_hard = hard;
+    cnd_broadcast(&q->space_cnd);
+    mtx_unlock(&q->mtx);
+}
+
+size_t memoryUsage(queue_t* q, queue_memory* stats)
+{
+    // Return the bytes the queue holds in memory, and the breakdown in *stats unless it is NULL.
+    // Items handed straight to a waiter are never held, spilled payloads are on disk and not part of the total
+    size_t total;
+    mtx_lock(&q->mtx);
+    total = mem_used(q);
+    if(stats != NULL)
+    {
+        stats->nodes = q->mem_nodes;
+        stats->waiters = q->mem_waiters;
+        stats->payload = q->mem_payload;
+        stats->structure = total - q->mem_nodes - q->mem_waiters - q->mem_payload;
+        stats->spilled = q->spill_cnt * q->spill_item_size;
+    }
+    mtx_unlock(&q->mtx);
+    return total;
+}
+
+void setWakePolicy(queue_t* q, wake_policy policy)
+{
+    // Choose which waiter gets the next item. WAKE_FIFO (the default) is fair, WAKE_LIFO keeps the most recently
+    // parked consumers busy and lets the others stay asleep, WAKE_AFFINITY also prefers a consumer with the
+    // producer's setAffinityHint. Items that are already ready are still dequeued in FIFO order
+    q->wake = policy;
+}
+
+void setAffinityHint(int hint)
+{
+    // Tag the calling thread with a locality group, e.g. its NUMA node or CPU cluster; -1 removes the tag.
+    // A thread pinned to a CPU should set it, the queue itself does not look at where threads run
+    call_once(&hint_once, hint_init);
+    tss_set(hint_key, (void*) (intptr_t) (hint + 1));
+}
+
+bool exportStats(queue_t* q, const char* name, unsigned period_ms)
+{
+    // Publish the queue's counters in the shared-memory object name (e.g. "/queue-stats", found under /dev/shm),
+    // refreshed every period_ms by a background thread. Readers map it read-only and retry on the page's seqlock,
+    // so reading costs no syscall and never touches the queue's mtx. false if the queue is already exported
+    // or the object cannot be created, including when name already exists
+    stats_export* x;
+    queue_stats_page* page;
+    int fd;
+    mtx_lock(&q->mtx);
+    if(q->stats != NULL)
+    {
+        mtx_unlock(&q->mtx);
+        return false;
+    }
+    mtx_unlock(&q->mtx);
+    //never take over an existing object, it may be another queue's page; from here on the object is ours
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0)
+    {
+        return false;
+    }
+    if(ftruncate(fd, sizeof(queue_stats_page)) != 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    page = mmap(NULL, sizeof(queue_stats_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(page == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return false;
+    }
+    x = malloc(sizeof(stats_export));
+    x->q = q;
+    x->page = page;
+    x->name = malloc(strlen(name) + 1);
+    strcpy(x->name, name);
+    x->period_ms = period_ms > 0 ? period_ms : 1;
+    x->stop = false;
+    mtx_init(&x->mtx, mtx_plain);
+    cnd_init(&x->cnd);
+    mtx_lock(&q->mtx);
+    if(q->stats != NULL)
+    {
+        //a concurrent exportStats won the race, drop the object we created
+        mtx_unlock(&q->mtx);
+        munmap(page, sizeof(queue_stats_page));
+        shm_unlink(name);
+        mtx_destroy(&x->mtx);
+        cnd_destroy(&x->cnd);
+        free(x->name);
+        free(x);
+        return false;
+    }
+    //the first write happens before the magic, so a reader that sees the magic sees counters too
+    stats_write(x);
+    atomic_store_explicit(&page->magic, QUEUE_STATS_MAGIC, memory_order_release);
+    q->stats = x;
+    mtx_unlock(&q->mtx);
+    thrd_create(&x->thread, stats_main, x);
+    return true;
+}
+
+void unexportStats(queue_t* q)
+{
+    // Stop publishing the counters and remove the shared-memory object, readers that have it mapped keep the last values
+    stats_export* x;
+    mtx_lock(&q->mtx);
+    x = q->stats;
+    q->stats = NULL;
+    mtx_unlock(&q->mtx);
+    if(x == NULL)
+    {
+        return;
+    }
+    mtx_lock(&x->mtx);
+    x->stop = true;
+    cnd_signal(&x->cnd);
+    mtx_unlock(&x->mtx);
+    thrd_join(x->thread, NULL);
+    munmap(x->page, sizeof(queue_stats_page));
+    shm_unlink(x->name);
+    mtx_destroy(&x->mtx);
+    cnd_destroy(&x->cnd);
+    free(x->name);
+    free(x);
+}
+
+size_t queueSize(queue_t* q)
+{
+    // Return the current size of the given queue, without taking a lock.
+    // visited is loaded first: an item is counted as enqueued before it can be visited, so this never underflows
+    size_t v = q->visited_cnt;
+    return q->enqueued_cnt - v;
+}
+
+size_t queueWaiting(queue_t* q)
+{
+    // Return the number of waiters registered on the given queue, dequeueAny waiters count once in every queue they wait on
+    mtx_lock(&q->mtx);
+    size_t w;
+    w = (size_t) q->waiting_cnt;
+    mtx_unlock(&q->mtx);
+    return w;
+}
+
+size_t queueVisited(queue_t* q)
+{
+    // Return the number of items dequeued from the given queue, without taking a lock
+    return (size_t) q->visited_cnt;
+}
+
+bool dequeueAny(queue_t** qs, size_t n, void** out, size_t* which)
+{
+    // Block until any of the n queues hands an item, store it in *out and its index in *which; false right away if n is 0.
+    // A single waiter record is registered in every empty queue; whichever queue serves it first marks it done
+    // under the waiter's own mtx, so the other registrations can never be handed an item and are then withdrawn.
+    waiter w;
+    wait_link local[ANY_STACK_REGS];
+    wait_link* regs; //registration per queue, owner is NULL where we did not register
+    wait_link* asyncs;
+    size_t i;
+    if(n == 0)
+    {
+        //nothing could ever wake us
+        return false;
+    }
+    regs = n <= ANY_STACK_REGS ? local : malloc(n * sizeof(wait_link));
+    w.kind = WAIT_ANY;
+    w.hint = wake_hint();
+    w.done = false;
+    w.data = NULL;
+    w.from = NULL;
+    cnd_init(&w.cnd);
+    mtx_init(&w.mtx, mtx_plain);
+    for(i = 0; i < n; i++)
+    {
+        regs[i].owner = NULL;
+        mtx_lock(&qs[i]->mtx);
+        mtx_lock(&w.mtx);
+        if(!w.done)
+        {
+            if(has_ready(qs[i]))
+            {
+                //an item is ready, take it now and stop registering
+                w.data = take_ready(qs[i]);
+                w.from = qs[i];
+                w.done = true;
+            }
+            else
+            {
+                wait_push(qs[i], &regs[i], &w);
+            }
+        }
+        mtx_unlock(&w.mtx);
+        //serving a staged item may pick our registration, which takes w.mtx itself
+        asyncs = regs[i].owner != NULL && qs[i]->stages != NULL ? stage_collect(qs[i]) : NULL;
+        mtx_unlock(&qs[i]->mtx);
+        run_asyncs(asyncs);
+    }
+
+    mtx_lock(&w.mtx);
+    while(!w.done)
+    {
+        cnd_wait(&w.cnd, &w.mtx);
+    }
+    mtx_unlock(&w.mtx);
+
+    for(i = 0; i < n; i++)
+    {
+        if(regs[i].owner != NULL)
+        {
+            //withdraw in O(1), unless the queue already dropped the registration when it reached it
+            mtx_lock(&qs[i]->mtx);
+            if(regs[i].linked)
+            {
+                wait_unlink(qs[i], &regs[i]);
+            }
+            mtx_unlock(&qs[i]->mtx);
+        }
+        if(qs[i] == w.from && which != NULL)
+        {
+            *which = i;
+        }
+    }
+    if(regs != local)
+    {
+        free(regs);
+    }
+    mtx_destroy(&w.mtx);
+    cnd_destroy(&w.cnd);
+    *out = w.data;
     return true;
 }
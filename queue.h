@@ -1,6 +1,60 @@
+#ifndef QUEUE_H
+#define QUEUE_H
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <time.h>
+#include <stdatomic.h>
+typedef struct queue_handle queue_t;
+typedef struct queue_backend
+{
+    const char* name;
+    void (*initQueue)(void);
+    void (*destroyQueue)(void);
+    void (*enqueue)(void*);
+    void* (*dequeue)(void);
+    bool (*tryDequeue)(void**);
+    size_t (*size)(void);
+    size_t (*waiting)(void);
+    size_t (*visited)(void);
+} queue_backend;
+typedef struct queue_memory
+{
+    size_t structure; // the queue itself, its list heads and flows
+    size_t nodes; // chunks and list nodes holding queued items
+    size_t waiters; // heap waiter records of pending dequeueAsync continuations
+    size_t payload; // declared payload bytes of queued items
+    size_t spilled; // payload bytes moved to disk, not part of the in-memory total
+} queue_memory;
+#define QUEUE_STATS_MAGIC 0x31545351u // "QST1", stored once the page holds its first counters
+#define QUEUE_STATS_BUCKETS 24 // wait_us[i] counts dequeues that slept [2^i, 2^(i+1)) us, [0] also the shorter ones
+typedef struct queue_stats_page
+{
+    _Atomic uint32_t magic;
+    _Atomic uint64_t seq; // odd while the page is being written, readers retry until they see the same even value twice
+    _Atomic uint64_t updated_us; // monotonic clock of the last write
+    _Atomic uint64_t depth;
+    _Atomic uint64_t waiting;
+    _Atomic uint64_t enqueued;
+    _Atomic uint64_t dequeued;
+    _Atomic uint64_t handoffs; // items given straight to a waiter, never queued
+    _Atomic uint64_t wait_us[QUEUE_STATS_BUCKETS];
+} queue_stats_page;
+typedef enum wake_policy
+{
+    WAKE_FIFO,
+    WAKE_LIFO,
+    WAKE_AFFINITY,
+} wake_policy;
+extern const queue_backend list_backend;
+extern const queue_backend combining_backend;
+extern const queue_backend queue2_backend;
+bool registerBackend(const queue_backend*);
+bool selectBackend(const char*);
+size_t listBackends(const queue_backend**, size_t);
+const queue_backend* currentBackend(void);
+bool startRecording(const char*);
+void stopRecording(void);
 void initQueue(void);
 void destroyQueue(void);
 void enqueue(void*);
@@ -9,3 +63,40 @@ bool tryDequeue(void**);
 size_t size(void);
 size_t waiting(void);
 size_t visited(void);
+bool initSpill(const char*, size_t, size_t);
+bool peek(void**);
+size_t snapshot(void**, size_t);
+bool initFairness(size_t);
+void setFlowWeight(size_t, size_t);
+void enqueueFlow(void*, size_t);
+bool dequeueAsync(void (*)(void*, void*), void*);
+size_t dequeueBatch(void**, size_t, size_t, const struct timespec*);
+void enqueueBuffered(void*);
+bool enqueueAfter(void*, const struct timespec*);
+void flushEnqueue(void);
+queue_t* newQueue(void);
+void freeQueue(queue_t*);
+queue_t* defaultQueue(void);
+void enqueueTo(queue_t*, void*);
+void enqueueBufferedTo(queue_t*, void*);
+void enqueueAfterTo(queue_t*, void*, const struct timespec*);
+void* dequeueFrom(queue_t*);
+bool tryDequeueFrom(queue_t*, void**);
+bool peekFrom(queue_t*, void**);
+size_t snapshotFrom(queue_t*, void**, size_t);
+bool dequeueAsyncFrom(queue_t*, void (*)(void*, void*), void*);
+size_t dequeueBatchFrom(queue_t*, void**, size_t, size_t, const struct timespec*);
+void setCombining(queue_t*, bool);
+bool enqueueSized(void*, size_t);
+bool enqueueSizedTo(queue_t*, void*, size_t);
+void setMemoryLimits(queue_t*, size_t, size_t);
+size_t memoryUsage(queue_t*, queue_memory*);
+void setWakePolicy(queue_t*, wake_policy);
+void setAffinityHint(int);
+bool exportStats(queue_t*, const char*, unsigned);
+void unexportStats(queue_t*);
+size_t queueSize(queue_t*);
+size_t queueWaiting(queue_t*);
+size_t queueVisited(queue_t*);
+bool dequeueAny(queue_t**, size_t, void**, size_t*);
+#endif
@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include "queue.h"
 
 typedef struct node_fifo
 {
@@ -39,13 +40,13 @@ typedef struct fifo_queue
     size_t visited;
 } queue;
 
-queue* q;
-cnd_queue* cnd;
-mtx_t mtx;
-queue* ready_to_deq;
-int cnt = 0;
+static queue* q;
+static cnd_queue* cnd;
+static mtx_t mtx;
+static queue* ready_to_deq;
+static int cnt = 0;
 
-void initQueue(void)
+static void queue2_initQueue(void)
 {
     ///This function will be called before the queue is used.
     ///It should initialize the queue and any other data structures
@@ -67,7 +68,7 @@ void initQueue(void)
     ready_to_deq->visited = 0;
 }
 
-void destroyQueue(void)
+static void queue2_destroyQueue(void)
 {
     ///This function will be called when the queue is no longer needed.
     ///It should clean up any memory or other resources used by the queue.
@@ -114,7 +115,7 @@ void destroyQueue(void)
     mtx_destroy(&mtx);
 }
 
-void enqueue(void* data)
+static void queue2_enqueue(void* data)
 {        
     ///This function will be called by the producer threads.
     ///It should add the given data pointer to the queue.
@@ -177,14 +178,12 @@ void enqueue(void* data)
     }
 }
 
-void* dequeue(void)
+static void* queue2_dequeue(void)
 {
     node_cnd* new_node = NULL;
     node_fifo* tmp;
     node_fifo* ret;
-    cnd_t c;
     void* data = NULL;
-    cnd_init(&c);
     mtx_lock(&mtx);
     if(ready_to_deq->head == NULL)
     {
@@ -193,12 +192,11 @@ void* dequeue(void)
         new_node->p = NULL;
         new_node->next = NULL;
         new_node->prev = NULL;
-        new_node->cond = c;
+        cnd_init(&new_node->cond);
         if (cnd->head == NULL)
         {
             cnd->head = new_node;
             cnd->tail = new_node;
-            cnd->nxt_deq = new_node;
         }
         else
         {
@@ -206,6 +204,11 @@ void* dequeue(void)
             new_node->prev = cnd->tail;
             cnd->tail = new_node;
         }
+        if (cnd->nxt_deq == NULL)
+        {
+            //every earlier waiter was already handed an item, this one is next
+            cnd->nxt_deq = new_node;
+        }
         cnd->waiting++;
         cnd_wait(&(new_node->cond), &mtx);
         ret = new_node->p;
@@ -249,15 +252,19 @@ void* dequeue(void)
     }
     if(ret!=NULL)
     {
-        if (ret->next != NULL)
-        {
-            ret->next->prev = ret->prev;
-        }
-        else
+        if (tmp != NULL)
         {
-            q->tail = ret->prev;
+            //ready items are linked into q, and the oldest ready item is always its head
+            if (ret->next != NULL)
+            {
+                ret->next->prev = ret->prev;
+            }
+            else
+            {
+                q->tail = ret->prev;
+            }
+            q->head = ret->next;
         }
-        q->head = ret->next;
         q->visited++;
         data = ret->data;
         free(ret);
@@ -288,11 +295,12 @@ void* dequeue(void)
     return data;
 }
 
-bool tryDequeue(void** ret)
+static bool queue2_tryDequeue(void** ret)
 {
-    node_fifo* tmp = ready_to_deq->head;
+    node_fifo* tmp;
     node_fifo* item;
     mtx_lock(&mtx);
+    tmp = ready_to_deq->head;
     if (tmp == NULL)
     {
         mtx_unlock(&mtx);
@@ -317,9 +325,9 @@ bool tryDequeue(void** ret)
         }
         else
         {
-            q->tail = NULL;
+            q->tail = item->prev;
         }
-        if (q->head->id == item->id)
+        if (item->prev == NULL)
         {
             q->head = item->next;
         }
@@ -336,12 +344,12 @@ bool tryDequeue(void** ret)
     }
 }
 
-size_t size(void)
+static size_t queue2_size(void)
 {
     return q->size;
 }
 
-size_t waiting(void)
+static size_t queue2_waiting(void)
 {
     size_t waiting;
     mtx_lock(&mtx);
@@ -350,7 +358,19 @@ size_t waiting(void)
     return waiting;
 }
 
-size_t visited(void)
+static size_t queue2_visited(void)
 {
     return q->visited;
 }
+
+const queue_backend queue2_backend = {
+    "queue2",
+    queue2_initQueue,
+    queue2_destroyQueue,
+    queue2_enqueue,
+    queue2_dequeue,
+    queue2_tryDequeue,
+    queue2_size,
+    queue2_waiting,
+    queue2_visited,
+};
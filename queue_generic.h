@@ -0,0 +1,249 @@
+#ifndef QUEUE_GENERIC_H
+#define QUEUE_GENERIC_H
+// Header-only typed queue, specialized at compile time so the hot paths inline into the caller:
+//
+//   QUEUE_DEFINE(name, T, capacity, locked, blocking)
+//
+// defines the type `name` and static inline functions name_init, name_destroy, name_enqueue, name_tryEnqueue,
+// name_tryDequeue, name_size and name_visited, plus name_dequeue and name_waiting when blocking is 1.
+// - T is stored by value, no boxing.
+// - capacity 0 is an unbounded queue that grows as needed, otherwise a ring of exactly that many items.
+// - locked 0 drops the mutex and the atomics, for a queue that only one thread uses at a time.
+// - blocking 1 adds the waiter list: dequeue sleeps in FIFO order among the waiters and the next item is handed
+//   to the oldest one directly, like dequeue in queue.c. A full bounded queue makes enqueue wait for room.
+// locked and blocking must be the literals 0 or 1. What is not asked for (mutex, waiter list, growth) is not compiled in.
+// QUEUE_DEFINE(name, void*, 0, 1, 1) has the semantics of queue.c.
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <threads.h>
+#include <stdatomic.h>
+
+#define QUEUE_IF_0(...)
+#define QUEUE_IF_1(...) __VA_ARGS__
+#define QUEUE_IF_(c, ...) QUEUE_IF_##c(__VA_ARGS__)
+#define QUEUE_IF(c, ...) QUEUE_IF_(c, __VA_ARGS__)
+
+#define QUEUE_DEFINE(name, T, capacity, locked, blocking) \
+_Static_assert((locked) || !(blocking), #name ": a blocking queue must be locked"); \
+\
+QUEUE_IF(blocking, \
+typedef struct name##_waiter \
+{ \
+    cnd_t cnd; \
+    bool done; \
+    T item; \
+    struct name##_waiter* next; \
+} name##_waiter;) \
+\
+typedef struct name \
+{ \
+    T* buf; /* ring of cap items starting at head */ \
+    size_t cap; \
+    size_t head; \
+    size_t len; \
+    QUEUE_IF(locked, _Atomic) size_t enqueued; \
+    QUEUE_IF(locked, _Atomic) size_t visited; \
+    QUEUE_IF(locked, mtx_t mtx;) \
+    QUEUE_IF(blocking, \
+    name##_waiter* wait_head; /* sleeping dequeues, oldest first */ \
+    name##_waiter* wait_tail; \
+    atomic_size_t waiting; \
+    cnd_t not_full; /* enqueues waiting for room in a bounded queue */) \
+} name; \
+\
+static inline bool name##_init(name* q) \
+{ \
+    /* Initialize an empty queue, false if the storage could not be allocated */ \
+    q->cap = (capacity) > 0 ? (capacity) : 16; \
+    q->buf = malloc(q->cap * sizeof(T)); \
+    q->head = 0; \
+    q->len = 0; \
+    q->enqueued = 0; \
+    q->visited = 0; \
+    QUEUE_IF(locked, mtx_init(&q->mtx, mtx_plain);) \
+    QUEUE_IF(blocking, \
+    q->wait_head = NULL; \
+    q->wait_tail = NULL; \
+    q->waiting = 0; \
+    cnd_init(&q->not_full);) \
+    return q->buf != NULL; \
+} \
+\
+static inline void name##_destroy(name* q) \
+{ \
+    /* Release the storage, the items still queued are dropped */ \
+    free(q->buf); \
+    QUEUE_IF(locked, mtx_destroy(&q->mtx);) \
+    QUEUE_IF(blocking, cnd_destroy(&q->not_full);) \
+} \
+\
+static inline bool name##_grow(name* q) \
+{ \
+    /* Double the ring of an unbounded queue, keeping the items in order */ \
+    T* buf = malloc(2 * q->cap * sizeof(T)); \
+    size_t i; \
+    if(buf == NULL) \
+    { \
+        return false; \
+    } \
+    for(i = 0; i < q->len; i++) \
+    { \
+        buf[i] = q->buf[(q->head + i) % q->cap]; \
+    } \
+    free(q->buf); \
+    q->buf = buf; \
+    q->head = 0; \
+    q->cap *= 2; \
+    return true; \
+} \
+\
+static inline bool name##_put(name* q, T item) \
+{ \
+    /* Hand the item to the oldest waiter or append it to the ring, false if there is no room. Caller holds the mtx */ \
+    size_t i; \
+    QUEUE_IF(blocking, \
+    name##_waiter* w = q->wait_head; \
+    if(w != NULL) \
+    { \
+        q->wait_head = w->next; \
+        if(q->wait_head == NULL) \
+        { \
+            q->wait_tail = NULL; \
+        } \
+        q->waiting--; \
+        q->enqueued++; \
+        q->visited++; \
+        w->item = item; \
+        w->done = true; \
+        cnd_signal(&w->cnd); \
+        return true; \
+    }) \
+    if(q->len == q->cap && ((capacity) > 0 || !name##_grow(q))) \
+    { \
+        return false; \
+    } \
+    i = q->head + q->len; \
+    if(i >= q->cap) \
+    { \
+        i -= q->cap; \
+    } \
+    q->buf[i] = item; \
+    q->len++; \
+    q->enqueued++; \
+    return true; \
+} \
+\
+static inline T name##_take(name* q) \
+{ \
+    /* Remove the oldest item, the caller holds the mtx and checked len > 0 */ \
+    T item = q->buf[q->head]; \
+    if(++q->head == q->cap) \
+    { \
+        q->head = 0; \
+    } \
+    q->len--; \
+    q->visited++; \
+    QUEUE_IF(blocking, \
+    if((capacity) > 0) \
+    { \
+        cnd_signal(&q->not_full); \
+    }) \
+    return item; \
+} \
+\
+static inline bool name##_tryEnqueue(name* q, T item) \
+{ \
+    /* Add the item without blocking, false if a bounded queue is full */ \
+    bool ok; \
+    QUEUE_IF(locked, mtx_lock(&q->mtx);) \
+    ok = name##_put(q, item); \
+    QUEUE_IF(locked, mtx_unlock(&q->mtx);) \
+    return ok; \
+} \
+\
+static inline bool name##_enqueue(name* q, T item) \
+{ \
+    /* Add the item; a blocking queue waits for room when bounded and full, otherwise that returns false */ \
+    bool ok; \
+    QUEUE_IF(locked, mtx_lock(&q->mtx);) \
+    ok = name##_put(q, item); \
+    QUEUE_IF(blocking, \
+    while(!ok && (capacity) > 0) \
+    { \
+        cnd_wait(&q->not_full, &q->mtx); \
+        ok = name##_put(q, item); \
+    }) \
+    QUEUE_IF(locked, mtx_unlock(&q->mtx);) \
+    return ok; \
+} \
+\
+static inline bool name##_tryDequeue(name* q, T* out) \
+{ \
+    /* Take the oldest queued item without blocking, false if there is none */ \
+    bool ok; \
+    QUEUE_IF(locked, mtx_lock(&q->mtx);) \
+    ok = q->len > 0; \
+    if(ok) \
+    { \
+        *out = name##_take(q); \
+    } \
+    QUEUE_IF(locked, mtx_unlock(&q->mtx);) \
+    return ok; \
+} \
+\
+QUEUE_IF(blocking, \
+static inline T name##_dequeue(name* q) \
+{ \
+    /* Take the oldest item, or sleep in FIFO order among the waiters until an enqueue hands one over */ \
+    name##_waiter w; \
+    T item; \
+    mtx_lock(&q->mtx); \
+    if(q->len > 0) \
+    { \
+        item = name##_take(q); \
+        mtx_unlock(&q->mtx); \
+        return item; \
+    } \
+    cnd_init(&w.cnd); \
+    w.done = false; \
+    w.next = NULL; \
+    if(q->wait_tail == NULL) \
+    { \
+        q->wait_head = &w; \
+    } \
+    else \
+    { \
+        q->wait_tail->next = &w; \
+    } \
+    q->wait_tail = &w; \
+    q->waiting++; \
+    while(!w.done) \
+    { \
+        cnd_wait(&w.cnd, &q->mtx); \
+    } \
+    mtx_unlock(&q->mtx); \
+    cnd_destroy(&w.cnd); \
+    return w.item; \
+} \
+\
+static inline size_t name##_waiting(name* q) \
+{ \
+    /* Number of threads sleeping in dequeue */ \
+    return q->waiting; \
+}) \
+\
+static inline size_t name##_size(name* q) \
+{ \
+    /* Items queued and not yet taken; visited is loaded first so this never underflows */ \
+    size_t v = q->visited; \
+    return q->enqueued - v; \
+} \
+\
+static inline size_t name##_visited(name* q) \
+{ \
+    /* Number of items dequeued so far */ \
+    return q->visited; \
+}
+
+#endif
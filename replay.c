@@ -0,0 +1,223 @@
+// Replay a trace written by startRecording against a queue backend, reporting throughput and enqueue-to-dequeue latency.
+// gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -pthread replay.c queue2.c -o replay
+// usage: ./replay trace [backend] [speed]
+// Every recorded thread gets a replay thread issuing the same calls in the same order. speed 1 keeps the recorded
+// timing, 2 runs twice as fast, 0 issues the calls back to back. The backend defaults to QUEUE_BACKEND or "list".
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "queue.c"
+
+typedef struct script
+{
+    trace_rec* recs; // the thread's calls in the order it made them
+    size_t n;
+    size_t cap;
+    uint64_t* latencies; // ns from enqueue to dequeue of each item this thread got
+    size_t got;
+    size_t starved; // blocking dequeues that had to be released with a pill
+} script;
+
+script* scripts;
+size_t num_scripts;
+double speed = 1.0;
+uint64_t replay_start;
+atomic_size_t finished;
+
+void sleep_until(uint64_t ns)
+{
+    // Sleep until the monotonic clock reaches ns
+    uint64_t now = clock_ns();
+    if(ns > now)
+    {
+        thrd_sleep(&(struct timespec){(time_t) ((ns - now) / 1000000000ULL), (long) ((ns - now) % 1000000000ULL)}, NULL);
+    }
+}
+
+void took(script* s, void* data)
+{
+    // Account for a dequeued token; NULL is a pill from main
+    if(data == NULL)
+    {
+        s->starved++;
+        return;
+    }
+    s->latencies[s->got++] = clock_ns() - *(uint64_t*) data;
+    free(data);
+}
+
+int replay_main(void* arg)
+{
+    // Issue one recorded thread's calls, at the recorded offsets unless speed is 0
+    script* s = arg;
+    uint64_t* token;
+    void* data;
+    s->latencies = malloc((s->n + 1) * sizeof(uint64_t));
+    s->got = 0;
+    s->starved = 0;
+    for(size_t i = 0; i < s->n; i++)
+    {
+        if(speed > 0)
+        {
+            sleep_until(replay_start + (uint64_t) (s->recs[i].start_ns / speed));
+        }
+        switch(s->recs[i].op & ~TRACE_OK)
+        {
+            case TRACE_ENQUEUE:
+                token = malloc(sizeof(uint64_t));
+                *token = clock_ns();
+                enqueue(token);
+                break;
+            case TRACE_DEQUEUE:
+                took(s, dequeue());
+                break;
+            case TRACE_TRY_DEQUEUE:
+                if(tryDequeue(&data))
+                {
+                    took(s, data);
+                }
+                break;
+        }
+    }
+    finished++;
+    return 0;
+}
+
+int cmp_u64(const void* a, const void* b)
+{
+    // qsort order of uint64_t
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+bool load(const char* path)
+{
+    // Read the trace and split it into one script per recorded thread, keeping each thread's call order
+    FILE* f = fopen(path, "rb");
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    trace_rec r;
+    script* s;
+    if(f == NULL || fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+    {
+        fprintf(stderr, "replay: %s is not a queue trace\n", path);
+        if(f != NULL)
+        {
+            fclose(f);
+        }
+        return false;
+    }
+    scripts = NULL;
+    num_scripts = 0;
+    while(fread(&r, sizeof(r), 1, f) == 1)
+    {
+        if(r.thread >= num_scripts)
+        {
+            scripts = realloc(scripts, (r.thread + 1) * sizeof(script));
+            memset(scripts + num_scripts, 0, (r.thread + 1 - num_scripts) * sizeof(script));
+            num_scripts = r.thread + 1;
+        }
+        s = &scripts[r.thread];
+        if(s->n == s->cap)
+        {
+            s->cap = s->cap > 0 ? 2 * s->cap : 64;
+            s->recs = realloc(s->recs, s->cap * sizeof(trace_rec));
+        }
+        s->recs[s->n++] = r;
+    }
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    thrd_t* threads;
+    uint64_t* all;
+    size_t total = 0;
+    size_t ops = 0;
+    size_t starved = 0;
+    size_t n = 0;
+    int stuck = 0;
+    uint64_t elapsed;
+    void* data;
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: %s trace [backend] [speed]\n", argv[0]);
+        return 2;
+    }
+    if(!load(argv[1]))
+    {
+        return 1;
+    }
+    if(argc > 3)
+    {
+        speed = strtod(argv[3], NULL);
+    }
+    registerBackend(&queue2_backend);
+    if(!selectBackend(argc > 2 ? argv[2] : NULL))
+    {
+        fprintf(stderr, "replay: unknown backend\n");
+        return 1;
+    }
+    initQueue();
+
+    threads = malloc(num_scripts * sizeof(thrd_t));
+    finished = 0;
+    replay_start = clock_ns();
+    for(size_t t = 0; t < num_scripts; t++)
+    {
+        thrd_create(&threads[t], replay_main, &scripts[t]);
+        ops += scripts[t].n;
+    }
+    //a replay can go differently from the recording; threads left blocked with nobody to feed them get a pill
+    //once every thread still running has been seen blocked on an empty queue twice in a row
+    while(finished < num_scripts)
+    {
+        stuck = size() == 0 && waiting() > 0 && waiting() == num_scripts - finished ? stuck + 1 : 0;
+        if(stuck == 2)
+        {
+            enqueue(NULL);
+            stuck = 0;
+        }
+        thrd_sleep(&(struct timespec){0, 1000000}, NULL);
+    }
+    elapsed = clock_ns() - replay_start;
+    for(size_t t = 0; t < num_scripts; t++)
+    {
+        thrd_join(threads[t], NULL);
+        total += scripts[t].got;
+        starved += scripts[t].starved;
+    }
+    while(tryDequeue(&data))
+    {
+        free(data);
+    }
+    destroyQueue();
+
+    all = malloc((total + 1) * sizeof(uint64_t));
+    for(size_t t = 0; t < num_scripts; t++)
+    {
+        memcpy(all + n, scripts[t].latencies, scripts[t].got * sizeof(uint64_t));
+        n += scripts[t].got;
+        free(scripts[t].latencies);
+        free(scripts[t].recs);
+    }
+    qsort(all, total, sizeof(uint64_t), cmp_u64);
+    printf("%s: %zu threads, %zu calls in %.3fs (%.0f calls/s), %zu items dequeued, %zu dequeues starved\n",
+           currentBackend()->name, num_scripts, ops, elapsed / 1e9, ops / (elapsed / 1e9), total, starved);
+    if(total > 0)
+    {
+        printf("latency ns: p50 %llu p99 %llu max %llu\n", (unsigned long long) all[total / 2],
+               (unsigned long long) all[total * 99 / 100], (unsigned long long) all[total - 1]);
+    }
+    free(all);
+    free(threads);
+    free(scripts);
+    return 0;
+}
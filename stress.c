@@ -0,0 +1,288 @@
+// Randomized stress test for every queue backend, or only the one named by QUEUE_BACKEND.
+// gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 -pthread stress.c queue2.c -o stress
+// Add -g -fsanitize=thread to run it under ThreadSanitizer.
+// usage: ./stress [seconds] [producers] [consumers] [sleepers] [max_ops_per_producer]
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "queue.c"
+
+#define NO_SEQ SIZE_MAX
+
+typedef struct item
+{
+    size_t producer;
+    size_t seq; // position in the producer's stream
+} item;
+
+size_t num_seconds = 5;
+size_t num_producers = 16;
+size_t num_consumers = 16;
+size_t num_sleepers = 256;
+size_t max_ops = 1000000;
+
+atomic_uchar** delivered; // delivered[p][seq] counts how many times the item was dequeued
+size_t* produced; // items each producer managed to enqueue
+atomic_bool stop;
+atomic_size_t producers_done; // producers that returned, early if they reached max_ops
+atomic_size_t misordered; // a consumer saw a producer's items out of order
+atomic_size_t consumed;
+
+unsigned long long now_ns(void)
+{
+    // Wall clock in nanoseconds
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+uint64_t next_rand(uint64_t* state)
+{
+    // xorshift64, one state per thread
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+int producer_main(void* arg)
+{
+    // Enqueue tagged items until the deadline or max_ops
+    size_t p = (size_t) (uintptr_t) arg;
+    size_t seq;
+    item* it;
+    for(seq = 0; seq < max_ops && !stop; seq++)
+    {
+        it = malloc(sizeof(item));
+        it->producer = p;
+        it->seq = seq;
+        enqueue(it);
+    }
+    produced[p] = seq;
+    producers_done++;
+    return 0;
+}
+
+int consumer_main(void* arg)
+{
+    // Mix blocking and non-blocking dequeues until a NULL pill arrives, checking per-producer order
+    uint64_t state = (uint64_t) (uintptr_t) arg * 0x9E3779B97F4A7C15ULL + 1;
+    size_t* last = malloc(num_producers * sizeof(size_t));
+    void* data;
+    item* it;
+    for(size_t p = 0; p < num_producers; p++)
+    {
+        last[p] = NO_SEQ;
+    }
+    while(true)
+    {
+        if(next_rand(&state) % 4 == 0)
+        {
+            if(!tryDequeue(&data))
+            {
+                thrd_yield();
+                continue;
+            }
+        }
+        else
+        {
+            data = dequeue();
+        }
+        if(data == NULL)
+        {
+            break;
+        }
+        it = (item*) data;
+        delivered[it->producer][it->seq]++;
+        //a FIFO queue never lets one consumer see a producer's items out of order
+        if(last[it->producer] != NO_SEQ && it->seq <= last[it->producer])
+        {
+            misordered++;
+        }
+        last[it->producer] = it->seq;
+        consumed++;
+        free(it);
+    }
+    free(last);
+    return 0;
+}
+
+size_t* sleeper_items;
+
+int sleeper_main(void* arg)
+{
+    // Block once and record which item was received
+    size_t i = (size_t) (uintptr_t) arg;
+    sleeper_items[i] = *(size_t*) dequeue();
+    return 0;
+}
+
+size_t run_mixed(void)
+{
+    // Producers and consumers race for num_seconds, or until every producer reached max_ops,
+    // then every item must have been delivered exactly once
+    thrd_t* producers = malloc(num_producers * sizeof(thrd_t));
+    thrd_t* consumers = malloc(num_consumers * sizeof(thrd_t));
+    size_t failures = 0;
+    size_t lost = 0;
+    size_t duplicated = 0;
+    size_t total = 0;
+    unsigned long long start;
+    unsigned long long deadline;
+    unsigned long long elapsed;
+
+    delivered = malloc(num_producers * sizeof(atomic_uchar*));
+    produced = malloc(num_producers * sizeof(size_t));
+    for(size_t p = 0; p < num_producers; p++)
+    {
+        delivered[p] = calloc(max_ops, sizeof(atomic_uchar));
+    }
+    stop = false;
+    producers_done = 0;
+    misordered = 0;
+    consumed = 0;
+
+    start = now_ns();
+    for(size_t c = 0; c < num_consumers; c++)
+    {
+        thrd_create(&consumers[c], consumer_main, (void*) (uintptr_t) c);
+    }
+    for(size_t p = 0; p < num_producers; p++)
+    {
+        thrd_create(&producers[p], producer_main, (void*) (uintptr_t) p);
+    }
+    //stop at the deadline, or as soon as every producer reached max_ops so the rate is not diluted by idle time
+    deadline = start + num_seconds * 1000000000ULL;
+    while(producers_done < num_producers && now_ns() < deadline)
+    {
+        thrd_sleep(&(struct timespec){0, 1000000}, NULL);
+    }
+    stop = true;
+    for(size_t p = 0; p < num_producers; p++)
+    {
+        thrd_join(producers[p], NULL);
+    }
+    //the pills queue up behind every item, so consumers drain the queue before leaving
+    for(size_t c = 0; c < num_consumers; c++)
+    {
+        enqueue(NULL);
+    }
+    for(size_t c = 0; c < num_consumers; c++)
+    {
+        thrd_join(consumers[c], NULL);
+    }
+    elapsed = now_ns() - start;
+
+    for(size_t p = 0; p < num_producers; p++)
+    {
+        total += produced[p];
+        for(size_t seq = 0; seq < produced[p]; seq++)
+        {
+            if(delivered[p][seq] == 0)
+            {
+                lost++;
+            }
+            else if(delivered[p][seq] > 1)
+            {
+                duplicated++;
+            }
+        }
+        free(delivered[p]);
+    }
+    free(delivered);
+    free(produced);
+    free(producers);
+    free(consumers);
+
+    printf("mixed: %zu items in %.2fs (%.0f items/s), lost %zu, duplicated %zu, misordered %zu\n",
+           total, elapsed / 1e9, total / (elapsed / 1e9), lost, duplicated, (size_t) misordered);
+    failures += lost + duplicated + misordered;
+    if(consumed != total)
+    {
+        printf("FAIL: consumed %zu of %zu items\n", (size_t) consumed, total);
+        failures++;
+    }
+    //quiescent state: everything passed through, nobody waits
+    if(size() != 0 || waiting() != 0 || visited() != total + num_consumers)
+    {
+        printf("FAIL: size %zu waiting %zu visited %zu, expected 0 0 %zu\n",
+               size(), waiting(), visited(), total + num_consumers);
+        failures++;
+    }
+    return failures;
+}
+
+size_t run_sleepers(void)
+{
+    // num_sleepers threads go to sleep one after the other, the k-th item must reach the k-th sleeper
+    thrd_t* threads = malloc(num_sleepers * sizeof(thrd_t));
+    size_t* values = malloc(num_sleepers * sizeof(size_t));
+    size_t failures = 0;
+    size_t before = visited();
+    sleeper_items = malloc(num_sleepers * sizeof(size_t));
+    for(size_t i = 0; i < num_sleepers; i++)
+    {
+        thrd_create(&threads[i], sleeper_main, (void*) (uintptr_t) i);
+        while(waiting() != i + 1)
+        {
+            thrd_yield();
+        }
+    }
+    for(size_t i = 0; i < num_sleepers; i++)
+    {
+        values[i] = i;
+        enqueue(&values[i]);
+    }
+    for(size_t i = 0; i < num_sleepers; i++)
+    {
+        thrd_join(threads[i], NULL);
+        if(sleeper_items[i] != i)
+        {
+            failures++;
+        }
+    }
+    printf("sleepers: %zu threads, %zu out of FIFO order\n", num_sleepers, failures);
+    if(size() != 0 || waiting() != 0 || visited() != before + num_sleepers)
+    {
+        printf("FAIL: size %zu waiting %zu visited %zu after sleepers\n", size(), waiting(), visited());
+        failures++;
+    }
+    free(sleeper_items);
+    free(values);
+    free(threads);
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    size_t failures = 0;
+    size_t* params[] = {&num_seconds, &num_producers, &num_consumers, &num_sleepers, &max_ops};
+    const queue_backend* all[QUEUE_MAX_BACKENDS];
+    size_t n;
+    for(int i = 1; i < argc && i <= 5; i++)
+    {
+        *params[i - 1] = strtoul(argv[i], NULL, 10);
+    }
+    registerBackend(&queue2_backend);
+    n = listBackends(all, QUEUE_MAX_BACKENDS);
+    for(size_t b = 0; b < n; b++)
+    {
+        if(getenv("QUEUE_BACKEND") != NULL && strcmp(getenv("QUEUE_BACKEND"), all[b]->name) != 0)
+        {
+            continue;
+        }
+        selectBackend(all[b]->name);
+        printf("=== Stress testing %s backend ===\n", all[b]->name);
+        initQueue();
+        failures += run_mixed();
+        failures += run_sleepers();
+        destroyQueue();
+    }
+    printf(failures == 0 ? "stress test passed.\n" : "stress test FAILED.\n");
+    return failures == 0 ? 0 : 1;
+}
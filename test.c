@@ -4,6 +4,9 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include "queue.c"
+#include "pool.c"
+#include "topic.c"
+#include "queue_generic.h"
 
 #define NUM_OPERATIONS 10
 #define MAX_SIZE 1000
@@ -524,6 +527,1131 @@ void test_mixed_operations()
     printf("mixed operations test passed.\n");
 }
 
+void test_spill()
+{
+    printf("=== Testing spill to disk ===\n");
+
+    initQueue();
+    assert(initSpill("/tmp", sizeof(int), 16));
+    assert(!initSpill("/tmp", sizeof(int), 4));
+
+    // Enqueue far more items than the high-water mark so several segments are used
+    int numItems = 3 * SPILL_SEG_ITEMS;
+    for (int i = 0; i < numItems; i++)
+    {
+        int *item = malloc(sizeof(int));
+        *item = i;
+        enqueue(item);
+    }
+    assert(size() == (size_t)numItems);
+    // A second call with items on disk is refused and keeps them
+    assert(!initSpill("/tmp", sizeof(int), 4));
+
+    // Items come back in FIFO order across the memory/disk boundary
+    for (int i = 0; i < numItems; i++)
+    {
+        int *item = (int *)dequeue();
+        assert(*item == i);
+        free(item);
+    }
+    assert(size() == 0);
+    assert(visited() == (size_t)numItems);
+
+    // Queue should be empty
+    void *item;
+    assert(!tryDequeue(&item));
+
+    // NULL items keep their place in the order without a payload
+    for (int i = 0; i < 32; i++)
+    {
+        int *item = malloc(sizeof(int));
+        *item = i;
+        enqueue(item);
+        enqueue(NULL);
+    }
+    for (int i = 0; i < 32; i++)
+    {
+        int *item = (int *)dequeue();
+        assert(*item == i);
+        free(item);
+        assert(dequeue() == NULL);
+    }
+
+    destroyQueue();
+
+    // When no segment file can be created enqueueSized fails, and what was accepted still comes back in order
+    char dir[] = "/tmp/queue-spill-test-XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    initQueue();
+    assert(initSpill(dir, sizeof(int), 16));
+    assert(rmdir(dir) == 0);
+    int accepted = 0;
+    while (true)
+    {
+        int *item = malloc(sizeof(int));
+        *item = accepted;
+        if (!enqueueSized(item, sizeof(int)))
+        {
+            free(item);
+            break;
+        }
+        accepted++;
+    }
+    assert(accepted == 16 + SPILL_SEG_ITEMS);
+    for (int i = 0; i < accepted; i++)
+    {
+        int *item = (int *)dequeue();
+        assert(*item == i);
+        free(item);
+    }
+    assert(size() == 0);
+
+    destroyQueue();
+
+    printf("spill to disk test passed.\n");
+}
+
+queue_t *any_queues[2];
+
+int dequeue_any_thread(void *arg)
+{
+    size_t *which = (size_t *)arg;
+    void *item;
+
+    dequeueAny(any_queues, 2, &item, which);
+
+    return *(int *)item;
+}
+
+void test_dequeueAny()
+{
+    printf("=== Testing dequeueAny ===\n");
+
+    initQueue();
+    any_queues[0] = defaultQueue();
+    any_queues[1] = newQueue();
+
+    // An item that is already ready is taken without sleeping
+    int item1 = 1;
+    enqueueTo(any_queues[1], &item1);
+    void *item;
+    size_t which;
+    assert(dequeueAny(any_queues, 2, &item, &which));
+    assert(item == &item1);
+
+    // With no queues nothing could ever wake the caller, it returns right away
+    assert(!dequeueAny(any_queues, 0, &item, &which));
+    assert(which == 1);
+
+    // A sleeping selector is woken by whichever queue gets an item first
+    thrd_t thread;
+    int value;
+    thrd_create(&thread, dequeue_any_thread, &which);
+    while (waiting() != 1 || queueWaiting(any_queues[1]) != 1)
+    {
+        thrd_yield();
+    }
+    int item2 = 2;
+    enqueueTo(any_queues[1], &item2);
+    thrd_join(thread, &value);
+    assert(value == 2);
+    assert(which == 1);
+
+    // The registration in the other queue was withdrawn, so its next item is not lost
+    assert(waiting() == 0);
+    assert(queueWaiting(any_queues[1]) == 0);
+    int item3 = 3;
+    enqueue(&item3);
+    assert(tryDequeue(&item));
+    assert(item == &item3);
+    assert(visited() == 1);
+    assert(queueVisited(any_queues[1]) == 2);
+
+    freeQueue(any_queues[1]);
+    destroyQueue();
+
+    printf("dequeueAny test passed.\n");
+}
+
+void test_peek_snapshot()
+{
+    printf("=== Testing peek and snapshot ===\n");
+
+    initQueue();
+
+    void *item;
+    void *items[8];
+    assert(!peek(&item));
+    assert(snapshot(items, 8) == 0);
+
+    int values[] = {1, 2, 3, 4, 5};
+    for (int i = 0; i < 5; i++)
+    {
+        enqueue(&values[i]);
+    }
+
+    // Peeking does not claim the item
+    assert(peek(&item));
+    assert(item == &values[0]);
+    assert(size() == 5);
+
+    // Snapshot copies in dequeue order and is bounded by max
+    assert(snapshot(items, 3) == 3);
+    for (int i = 0; i < 3; i++)
+    {
+        assert(items[i] == &values[i]);
+    }
+    assert(snapshot(items, 8) == 5);
+
+    assert(tryDequeue(&item));
+    assert(item == &values[0]);
+    assert(peek(&item));
+    assert(item == &values[1]);
+    assert(visited() == 1);
+
+    destroyQueue();
+
+    printf("peek and snapshot test passed.\n");
+}
+
+void test_fairness()
+{
+    printf("=== Testing fair flows ===\n");
+
+    initQueue();
+    assert(initFairness(2));
+    setFlowWeight(0, 3);
+
+    // Flow 0 floods the queue, flow 1 only has two items
+    int noisy[9];
+    int quiet[2];
+    for (int i = 0; i < 9; i++)
+    {
+        noisy[i] = i;
+        enqueueFlow(&noisy[i], 0);
+    }
+    quiet[0] = 100;
+    quiet[1] = 101;
+    enqueueFlow(&quiet[0], 1);
+    enqueueFlow(&quiet[1], 1);
+    assert(size() == 11);
+
+    // Flow 0 gets 3 items per round, flow 1 gets 1, each flow stays FIFO
+    int expected[] = {0, 1, 2, 100, 3, 4, 5, 101, 6, 7, 8};
+    void *ahead[11];
+    assert(snapshot(ahead, 11) == 11);
+    for (int i = 0; i < 11; i++)
+    {
+        assert(*(int *)ahead[i] == expected[i]);
+    }
+    for (int i = 0; i < 11; i++)
+    {
+        // peek follows the round-robin mid-round too
+        assert(peek(ahead));
+        assert(*(int *)ahead[0] == expected[i]);
+        int *item = (int *)dequeue();
+        printf("Dequeued: %d\n", *item);
+        assert(*item == expected[i]);
+    }
+    assert(size() == 0);
+
+    // Plain enqueue feeds flow 0 and waiter handoff is unchanged
+    void *item;
+    assert(!tryDequeue(&item));
+    enqueue(&noisy[0]);
+    assert(tryDequeue(&item));
+    assert(item == &noisy[0]);
+
+    destroyQueue();
+
+    printf("fair flows test passed.\n");
+}
+
+void async_callback(void *item, void *ctx)
+{
+    *(int *)ctx = *(int *)item;
+}
+
+void test_dequeueAsync()
+{
+    printf("=== Testing dequeueAsync ===\n");
+
+    initQueue();
+
+    // A ready item runs the continuation right away
+    int item1 = 1;
+    int result = 0;
+    enqueue(&item1);
+    assert(dequeueAsync(async_callback, &result));
+    assert(result == 1);
+
+    // Sync and async waiters share one FIFO order: the thread went to sleep first
+    thrd_t thread;
+    int order = -1;
+    thrd_create(&thread, consumer_thread, &order);
+    while (waiting() != 1)
+    {
+        thrd_yield();
+    }
+    result = 0;
+    assert(!dequeueAsync(async_callback, &result));
+    assert(waiting() == 2);
+
+    int item2 = 2;
+    int item3 = 3;
+    enqueue(&item2);
+    thrd_join(thread, NULL);
+    assert(order == 2);
+    assert(result == 0);
+    enqueue(&item3);
+    assert(result == 3);
+
+    assert(waiting() == 0);
+    assert(size() == 0);
+    assert(visited() == 3);
+
+    // A continuation still pending at destroy time is released by the queue
+    assert(!dequeueAsync(async_callback, &result));
+
+    destroyQueue();
+
+    printf("dequeueAsync test passed.\n");
+}
+
+void test_combining()
+{
+    printf("=== Testing combining front end ===\n");
+
+    initQueue();
+    setCombining(defaultQueue(), true);
+
+    int items[] = {1, 2, 3, 4, 5};
+    void *item;
+    assert(!tryDequeue(&item));
+    for (int i = 0; i < 5; i++)
+    {
+        enqueue(&items[i]);
+    }
+    assert(size() == 5);
+    for (int i = 0; i < 5; i++)
+    {
+        assert(tryDequeue(&item));
+        assert(item == &items[i]);
+    }
+
+    // Combined enqueues still hand items to sleeping threads
+    int order = -1;
+    thrd_t thread;
+    thrd_create(&thread, consumer_thread, &order);
+    while (waiting() != 1)
+    {
+        thrd_yield();
+    }
+    enqueue(&items[0]);
+    thrd_join(thread, NULL);
+    assert(order == 1);
+    assert(visited() == 6);
+
+    destroyQueue();
+
+    printf("combining front end test passed.\n");
+}
+
+atomic_int pool_counter;
+
+int pool_task_thread(void *arg)
+{
+    (void)arg;
+    pool_counter++;
+    return 0;
+}
+
+atomic_int pool_started;
+atomic_bool pool_gate;
+
+int pool_gate_thread(void *arg)
+{
+    (void)arg;
+    pool_started++;
+    while (!pool_gate)
+    {
+        thrd_yield();
+    }
+    pool_counter++;
+    return 0;
+}
+
+int pool_where_thread(void *arg)
+{
+    *(thrd_t *)arg = thrd_current();
+    pool_counter++;
+    return 0;
+}
+
+queue_t *memory_queue;
+int memory_items[3];
+
+int sized_producer_thread(void *arg)
+{
+    (void)arg;
+    return enqueueSizedTo(memory_queue, &memory_items[2], 100);
+}
+
+void test_memory()
+{
+    printf("=== Testing memory accounting and limits ===\n");
+
+    memory_queue = newQueue();
+    queue_memory stats;
+    size_t empty = memoryUsage(memory_queue, &stats);
+    assert(stats.nodes == 0 && stats.payload == 0 && stats.waiters == 0);
+    assert(empty == stats.structure);
+
+    // Declared payload bytes count until the item is dequeued
+    assert(enqueueSizedTo(memory_queue, &memory_items[0], 100));
+    size_t one = memoryUsage(memory_queue, &stats);
+    assert(stats.payload == 100);
+    assert(one == empty + 100 + stats.nodes);
+
+    // Past the hard limit a sized enqueue is rejected and nothing is queued
+    setMemoryLimits(memory_queue, 0, one + 50);
+    assert(!enqueueSizedTo(memory_queue, &memory_items[1], 100));
+    assert(queueSize(memory_queue) == 1);
+
+    // Past the soft limit the producer blocks until a dequeue makes room
+    setMemoryLimits(memory_queue, one + 50, 0);
+    thrd_t thread;
+    int ok;
+    thrd_create(&thread, sized_producer_thread, NULL);
+    thrd_sleep(&(struct timespec){0, 50000000}, NULL);
+    assert(queueSize(memory_queue) == 1);
+    assert(dequeueFrom(memory_queue) == &memory_items[0]);
+    thrd_join(thread, &ok);
+    assert(ok);
+    assert(dequeueFrom(memory_queue) == &memory_items[2]);
+    // The payload is gone, the emptied chunk is kept for the next items
+    memoryUsage(memory_queue, &stats);
+    assert(stats.payload == 0);
+    assert(stats.nodes == sizeof(chunk));
+
+    // Sized enqueues that go through the combining front end keep their declared bytes
+    setMemoryLimits(memory_queue, 0, 0);
+    setCombining(memory_queue, true);
+    assert(enqueueSizedTo(memory_queue, &memory_items[0], 100));
+    assert(enqueueSizedTo(memory_queue, &memory_items[1], 100));
+    memoryUsage(memory_queue, &stats);
+    assert(stats.payload == 200);
+    assert(dequeueFrom(memory_queue) == &memory_items[0]);
+    assert(dequeueFrom(memory_queue) == &memory_items[1]);
+    memoryUsage(memory_queue, &stats);
+    assert(stats.payload == 0);
+
+    freeQueue(memory_queue);
+
+    printf("memory accounting test passed.\n");
+}
+
+QUEUE_DEFINE(int_queue, int, 0, 1, 1)
+QUEUE_DEFINE(ring_queue, int, 4, 0, 0)
+
+int_queue generic_queue;
+
+int generic_consumer_thread(void *arg)
+{
+    (void)arg;
+    return int_queue_dequeue(&generic_queue);
+}
+
+void test_generic()
+{
+    printf("=== Testing generic queue ===\n");
+
+    // Unbounded blocking queue of ints, same semantics as the void* queue
+    assert(int_queue_init(&generic_queue));
+    int value;
+    assert(!int_queue_tryDequeue(&generic_queue, &value));
+    for (int i = 0; i < 100; i++)
+    {
+        assert(int_queue_enqueue(&generic_queue, i));
+    }
+    assert(int_queue_size(&generic_queue) == 100);
+    for (int i = 0; i < 100; i++)
+    {
+        assert(int_queue_dequeue(&generic_queue) == i);
+    }
+    thrd_t thread;
+    thrd_create(&thread, generic_consumer_thread, NULL);
+    while (int_queue_waiting(&generic_queue) != 1)
+    {
+        thrd_yield();
+    }
+    int_queue_enqueue(&generic_queue, 7);
+    thrd_join(thread, &value);
+    assert(value == 7);
+    assert(int_queue_visited(&generic_queue) == 101);
+    int_queue_destroy(&generic_queue);
+
+    // Bounded single-threaded ring: rejects when full, keeps FIFO order across the wrap
+    ring_queue ring;
+    assert(ring_queue_init(&ring));
+    for (int i = 0; i < 4; i++)
+    {
+        assert(ring_queue_tryEnqueue(&ring, i));
+    }
+    assert(!ring_queue_enqueue(&ring, 4));
+    assert(ring_queue_tryDequeue(&ring, &value) && value == 0);
+    assert(ring_queue_enqueue(&ring, 4));
+    for (int i = 1; i < 5; i++)
+    {
+        assert(ring_queue_tryDequeue(&ring, &value) && value == i);
+    }
+    assert(ring_queue_size(&ring) == 0);
+    ring_queue_destroy(&ring);
+
+    printf("generic queue test passed.\n");
+}
+
+void *batch_items[8];
+
+int batch_thread(void *arg)
+{
+    (void)arg;
+    return (int)dequeueBatch(batch_items, 4, 8, NULL);
+}
+
+void test_dequeueBatch()
+{
+    printf("=== Testing dequeueBatch ===\n");
+
+    initQueue();
+
+    // Enough ready items: taken at once, up to max
+    int items[] = {1, 2, 3, 4, 5};
+    void *out[8];
+    for (int i = 0; i < 3; i++)
+    {
+        enqueue(&items[i]);
+    }
+    assert(dequeueBatch(out, 2, 2, NULL) == 2);
+    assert(out[0] == &items[0] && out[1] == &items[1]);
+    assert(dequeueBatch(out, 1, 8, NULL) == 1);
+    assert(out[0] == &items[2]);
+
+    // A sleeping batch collects handed items and is woken once it has its minimum
+    thrd_t thread;
+    int got;
+    thrd_create(&thread, batch_thread, NULL);
+    while (waiting() != 1)
+    {
+        thrd_yield();
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        enqueue(&items[i]);
+        assert(i == 3 || waiting() == 1);
+    }
+    thrd_join(thread, &got);
+    assert(got == 4);
+    for (int i = 0; i < 4; i++)
+    {
+        assert(batch_items[i] == &items[i]);
+    }
+
+    // The linger deadline returns a short batch and withdraws the waiter
+    enqueue(&items[4]);
+    struct timespec linger = {0, 20000000};
+    assert(dequeueBatch(out, 3, 8, &linger) == 1);
+    assert(out[0] == &items[4]);
+    assert(waiting() == 0);
+    assert(size() == 0);
+    assert(visited() == 8);
+
+    destroyQueue();
+
+    printf("dequeueBatch test passed.\n");
+}
+
+typedef struct idle_producer
+{
+    queue_t *q;
+    int *item;
+    atomic_bool staged;
+    atomic_bool release;
+} idle_producer;
+
+int idle_producer_thread(void *arg)
+{
+    idle_producer *p = (idle_producer *)arg;
+    enqueueBufferedTo(p->q, p->item);
+    p->staged = true;
+    while (!p->release)
+    {
+        thrd_yield();
+    }
+    return 0;
+}
+
+void test_enqueueBuffered()
+{
+    printf("=== Testing buffered enqueue ===\n");
+
+    initQueue();
+
+    // Staged items stay invisible until flushed, then arrive in order
+    int items[STAGE_ITEMS + 1];
+    void *item;
+    for (int i = 0; i < 3; i++)
+    {
+        enqueueBuffered(&items[i]);
+    }
+    assert(size() == 0);
+    assert(!tryDequeue(&item));
+    flushEnqueue();
+    assert(size() == 3);
+    for (int i = 0; i < 3; i++)
+    {
+        assert(dequeue() == &items[i]);
+    }
+
+    // A full buffer publishes itself
+    for (int i = 0; i < STAGE_ITEMS; i++)
+    {
+        enqueueBuffered(&items[i]);
+    }
+    assert(size() == STAGE_ITEMS);
+    for (int i = 0; i < STAGE_ITEMS; i++)
+    {
+        assert(dequeue() == &items[i]);
+    }
+
+    // A sleeping consumer gets the item without a flush
+    int order = -1;
+    thrd_t thread;
+    thrd_create(&thread, consumer_thread, &order);
+    while (waiting() != 1)
+    {
+        thrd_yield();
+    }
+    items[0] = 1;
+    enqueueBuffered(&items[0]);
+    thrd_join(thread, NULL);
+    assert(order == 1);
+    assert(size() == 0);
+
+    // A consumer that goes to sleep publishes what an idle producer left staged
+    idle_producer producer = {defaultQueue(), &items[1], false, false};
+    items[1] = 2;
+    thrd_create(&thread, idle_producer_thread, &producer);
+    while (!producer.staged)
+    {
+        thrd_yield();
+    }
+    assert(dequeue() == &items[1]);
+    producer.release = true;
+    thrd_join(thread, NULL);
+
+    // Items staged for a queue that is destroyed are dropped, not published into the next one
+    enqueueBuffered(&items[2]);
+    destroyQueue();
+    initQueue();
+    flushEnqueue();
+    assert(size() == 0);
+
+    // A producer thread may outlive the queue it staged items for
+    producer.q = newQueue();
+    producer.staged = false;
+    producer.release = false;
+    thrd_create(&thread, idle_producer_thread, &producer);
+    while (!producer.staged)
+    {
+        thrd_yield();
+    }
+    freeQueue(producer.q);
+    producer.release = true;
+    thrd_join(thread, NULL);
+
+    destroyQueue();
+
+    printf("buffered enqueue test passed.\n");
+}
+
+int recording_thread(void *arg)
+{
+    enqueue(arg);
+    dequeue();
+    return 0;
+}
+
+void test_recording()
+{
+    printf("=== Testing recording ===\n");
+
+    initQueue();
+    char path[] = "/tmp/queue-trace-XXXXXX";
+    close(mkstemp(path));
+    assert(startRecording(path));
+    assert(!startRecording(path));
+
+    int item = 1;
+    void *out;
+    enqueue(&item);
+    assert(tryDequeue(&out));
+    assert(!tryDequeue(&out));
+    enqueue(&item);
+    assert(dequeue() == &item);
+    stopRecording();
+    // Calls after stopRecording are not logged
+    enqueue(&item);
+    dequeue();
+
+    FILE *f = fopen(path, "rb");
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    assert(fread(magic, 1, sizeof(magic), f) == sizeof(magic));
+    assert(memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0);
+    trace_rec recs[8];
+    assert(fread(recs, sizeof(trace_rec), 8, f) == 5);
+    fclose(f);
+    unlink(path);
+    uint32_t ops[] = {TRACE_ENQUEUE | TRACE_OK, TRACE_TRY_DEQUEUE | TRACE_OK, TRACE_TRY_DEQUEUE,
+                      TRACE_ENQUEUE | TRACE_OK, TRACE_DEQUEUE | TRACE_OK};
+    for (int i = 0; i < 5; i++)
+    {
+        assert(recs[i].op == ops[i]);
+        assert(recs[i].thread == recs[0].thread);
+        assert(recs[i].start_ns <= recs[i].end_ns);
+        assert(i == 0 || recs[i - 1].end_ns <= recs[i].start_ns);
+    }
+
+    // A second recording numbers its threads from 0 again, counting only the threads that record in it
+    assert(startRecording(path));
+    thrd_t thread;
+    thrd_create(&thread, recording_thread, &item);
+    thrd_join(thread, NULL);
+    stopRecording();
+    f = fopen(path, "rb");
+    assert(fread(magic, 1, sizeof(magic), f) == sizeof(magic));
+    assert(fread(recs, sizeof(trace_rec), 8, f) == 2);
+    fclose(f);
+    unlink(path);
+    assert(recs[0].thread == 0 && recs[1].thread == 0);
+
+    destroyQueue();
+
+    printf("recording test passed.\n");
+}
+
+void test_enqueueAfter()
+{
+    printf("=== Testing enqueueAfter ===\n");
+
+    initQueue();
+
+    // Delayed items are invisible until due, then come out in due order
+    int items[] = {30, 10, 80};
+    void *item;
+    struct timespec start;
+    struct timespec end;
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < 3; i++)
+    {
+        enqueueAfter(&items[i], &(struct timespec){0, items[i] * 1000000L});
+    }
+    assert(size() == 0);
+    assert(!tryDequeue(&item));
+    assert(dequeue() == &items[1]);
+    assert(dequeue() == &items[0]);
+    assert(dequeue() == &items[2]);
+    timespec_get(&end, TIME_UTC);
+    assert((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000 >= 80);
+
+    // A zero delay is a plain enqueue, an item still pending at destroy is dropped
+    enqueueAfter(&items[0], &(struct timespec){0, 0});
+    assert(tryDequeue(&item) && item == &items[0]);
+    enqueueAfter(&items[0], &(struct timespec){3600, 0});
+    assert(visited() == 4);
+
+    destroyQueue();
+
+    printf("enqueueAfter test passed.\n");
+}
+
+atomic_size_t topic_released;
+
+void topic_release(void *item)
+{
+    (void)item;
+    topic_released++;
+}
+
+int topic_reader_thread(void *arg)
+{
+    return *(int *)topic_read((topic_sub_t *)arg);
+}
+
+void test_topic()
+{
+    printf("=== Testing topic ===\n");
+
+    topic_t *t = topic_create(topic_release);
+    int items[1000];
+    void *item;
+
+    // Every subscriber sees every item once, in publish order
+    topic_sub_t *a = topic_subscribe(t);
+    topic_sub_t *b = topic_subscribe(t);
+    for (int i = 0; i < 1000; i++)
+    {
+        items[i] = i;
+        topic_publish(t, &items[i]);
+    }
+    assert(topic_backlog(a) == 1000);
+    for (int i = 0; i < 1000; i++)
+    {
+        assert(topic_read(a) == &items[i]);
+    }
+    assert(!topic_try_read(a, &item));
+
+    // Segments stay alive for the slowest subscriber, then are reclaimed
+    size_t segments = topic_segments(t);
+    assert(segments > 1);
+    assert(topic_released == 0);
+    for (int i = 0; i < 1000; i++)
+    {
+        assert(topic_try_read(b, &item) && item == &items[i]);
+    }
+    assert(topic_segments(t) == 1);
+    assert(topic_released == 1000 - 1000 % 256);
+
+    // A late subscriber starts at the next item, a blocked reader wakes on publish
+    topic_sub_t *c = topic_subscribe(t);
+    assert(topic_backlog(c) == 0);
+    thrd_t thread;
+    int value;
+    thrd_create(&thread, topic_reader_thread, c);
+    thrd_sleep(&(struct timespec){0, 20000000}, NULL);
+    topic_publish(t, &items[7]);
+    thrd_join(thread, &value);
+    assert(value == 7);
+    assert(topic_read(a) == &items[7]);
+    assert(topic_read(b) == &items[7]);
+
+    topic_unsubscribe(a);
+    topic_unsubscribe(b);
+    topic_unsubscribe(c);
+    topic_destroy(t);
+    assert(topic_released == 1001);
+
+    printf("topic test passed.\n");
+}
+
+typedef struct hinted_consumer
+{
+    int hint;
+    int got;
+} hinted_consumer;
+
+int hinted_consumer_thread(void *arg)
+{
+    hinted_consumer *c = (hinted_consumer *)arg;
+    setAffinityHint(c->hint);
+    c->got = *(int *)dequeue();
+    return 0;
+}
+
+void test_wake_policy()
+{
+    printf("=== Testing wake policies ===\n");
+
+    initQueue();
+    int items[] = {1, 2, 3};
+    thrd_t threads[3];
+    hinted_consumer consumers[3] = {{0, -1}, {1, -1}, {0, -1}};
+
+    // LIFO hands the first item to the consumer that went to sleep last
+    setWakePolicy(defaultQueue(), WAKE_LIFO);
+    for (int i = 0; i < 3; i++)
+    {
+        thrd_create(&threads[i], hinted_consumer_thread, &consumers[i]);
+        while (waiting() != (size_t)i + 1)
+        {
+            thrd_yield();
+        }
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        enqueue(&items[i]);
+        thrd_join(threads[2 - i], NULL);
+        assert(consumers[2 - i].got == items[i]);
+    }
+
+    // AFFINITY prefers a sleeper with the producer's hint, then falls back to LIFO
+    setWakePolicy(defaultQueue(), WAKE_AFFINITY);
+    for (int i = 0; i < 3; i++)
+    {
+        thrd_create(&threads[i], hinted_consumer_thread, &consumers[i]);
+        while (waiting() != (size_t)i + 1)
+        {
+            thrd_yield();
+        }
+    }
+    setAffinityHint(1);
+    enqueue(&items[0]);
+    thrd_join(threads[1], NULL);
+    assert(consumers[1].got == 1);
+    enqueue(&items[1]);
+    thrd_join(threads[2], NULL);
+    assert(consumers[2].got == 2);
+    setAffinityHint(-1);
+    enqueue(&items[2]);
+    thrd_join(threads[0], NULL);
+    assert(consumers[0].got == 3);
+    assert(waiting() == 0);
+
+    destroyQueue();
+
+    printf("wake policy test passed.\n");
+}
+
+void test_exportStats()
+{
+    printf("=== Testing exportStats ===\n");
+
+    initQueue();
+    int items[] = {1, 2, 3};
+    thrd_t consumer;
+    hinted_consumer c = {-1, -1};
+    queue_stats_page snap;
+    uint64_t seq;
+    uint64_t waits = 0;
+
+    shm_unlink("/queue-test-stats");
+    assert(exportStats(defaultQueue(), "/queue-test-stats", 1));
+    assert(!exportStats(defaultQueue(), "/queue-test-stats", 1));
+    // Another queue cannot take over the name, the first page stays in place
+    queue_t* other = newQueue();
+    assert(!exportStats(other, "/queue-test-stats", 1));
+    freeQueue(other);
+    int fd = shm_open("/queue-test-stats", O_RDONLY, 0);
+    assert(fd >= 0);
+    queue_stats_page *page = mmap(NULL, sizeof(queue_stats_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    assert(page != MAP_FAILED);
+    assert(page->magic == QUEUE_STATS_MAGIC);
+
+    // One item goes straight to a sleeping consumer, two stay queued
+    thrd_create(&consumer, hinted_consumer_thread, &c);
+    while (waiting() != 1)
+    {
+        thrd_yield();
+    }
+    enqueue(&items[0]);
+    thrd_join(consumer, NULL);
+    assert(c.got == 1);
+    enqueue(&items[1]);
+    enqueue(&items[2]);
+
+    // The export thread catches up within a few periods, read it the way a monitor would
+    do
+    {
+        thrd_sleep(&(struct timespec){0, 2000000}, NULL);
+        do
+        {
+            seq = page->seq;
+            snap.depth = page->depth;
+            snap.enqueued = page->enqueued;
+        } while ((seq & 1) || seq != page->seq);
+    } while (snap.enqueued != 3);
+    assert(snap.depth == 2);
+
+    // unexportStats writes the final values and removes the object, the mapping stays readable
+    dequeue();
+    unexportStats(defaultQueue());
+    assert(page->enqueued == 3);
+    assert(page->dequeued == 2);
+    assert(page->depth == 1);
+    assert(page->waiting == 0);
+    assert(page->handoffs == 1);
+    for (int i = 0; i < QUEUE_STATS_BUCKETS; i++)
+    {
+        waits += page->wait_us[i];
+    }
+    assert(waits == 1);
+    assert(shm_open("/queue-test-stats", O_RDONLY, 0) < 0);
+    munmap(page, sizeof(queue_stats_page));
+
+    destroyQueue();
+
+    printf("exportStats test passed.\n");
+}
+
+void test_pool()
+{
+    printf("=== Testing thread pool ===\n");
+
+    pool_counter = 0;
+    pool_t *pool = pool_create(4);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        pool_submit(pool, pool_task_thread, NULL);
+    }
+    pool_wait(pool);
+    assert(pool_counter == 1000);
+    assert(pool_completed(pool) == 1000);
+
+    // Every task was run by one of the 4 workers, and each of them spent time both waiting and working
+    pool_worker_stats stats[8];
+    size_t n = pool_stats(pool, stats, 8);
+    unsigned long long tasks = 0;
+    unsigned long long idle = 0;
+    assert(n == 4);
+    for (size_t i = 0; i < n; i++)
+    {
+        tasks += stats[i].tasks;
+        idle += stats[i].idle_ns;
+        assert(stats[i].tasks == 0 || stats[i].busy_ns > 0);
+    }
+    assert(tasks == 1000);
+    assert(idle > 0);
+
+    // Shrink and grow at runtime, the pool keeps serving tasks
+    pool_resize(pool, 1);
+    assert(pool_threads(pool) == 1);
+    for (int i = 0; i < 100; i++)
+    {
+        pool_submit(pool, pool_task_thread, NULL);
+    }
+    pool_resize(pool, 3);
+    assert(pool_threads(pool) == 3);
+    for (int i = 0; i < 100; i++)
+    {
+        pool_submit(pool, pool_task_thread, NULL);
+    }
+    pool_wait(pool);
+    assert(pool_counter == 1200);
+
+    // A worker that took a poison pill is listed until it has stopped, the shrink settles at 3
+    while ((n = pool_stats(pool, stats, 8)) > 3)
+    {
+        thrd_yield();
+    }
+    assert(n == 3);
+
+    // Occupy the 3 workers and leave one task queued: with a threshold of 1 the next task runs in the submitter
+    pool_started = 0;
+    pool_gate = false;
+    for (int i = 0; i < 3; i++)
+    {
+        pool_submit(pool, pool_gate_thread, NULL);
+    }
+    while (pool_started != 3)
+    {
+        thrd_yield();
+    }
+    pool_submit(pool, pool_task_thread, NULL);
+    pool_caller_runs(pool, 1);
+    thrd_t ran_on;
+    pool_submit(pool, pool_where_thread, &ran_on);
+    assert(pool_counter == 1201);
+    assert(thrd_equal(ran_on, thrd_current()));
+    pool_caller_runs(pool, 0);
+    pool_gate = true;
+    pool_wait(pool);
+    assert(pool_counter == 1205);
+    assert(pool_completed(pool) == 1205);
+
+    pool_destroy(pool);
+
+    printf("thread pool test passed.\n");
+}
+
+// A minimal backend that keeps its items away from main_q, like queue2 does
+void *stub_items[8];
+size_t stub_cnt;
+
+void stub_initQueue(void)
+{
+    stub_cnt = 0;
+}
+
+void stub_enqueue(void *data)
+{
+    stub_items[stub_cnt++] = data;
+}
+
+void *stub_dequeue(void)
+{
+    return stub_items[--stub_cnt];
+}
+
+bool stub_tryDequeue(void **point)
+{
+    if (stub_cnt == 0)
+    {
+        return false;
+    }
+    *point = stub_items[--stub_cnt];
+    return true;
+}
+
+size_t stub_size(void)
+{
+    return stub_cnt;
+}
+
+size_t stub_zero(void)
+{
+    return 0;
+}
+
+const queue_backend stub_backend = {
+    "stub", stub_initQueue, stub_initQueue, stub_enqueue, stub_dequeue, stub_tryDequeue, stub_size, stub_zero, stub_zero,
+};
+
+void async_never(void *item, void *ctx)
+{
+    (void)item;
+    *(bool *)ctx = true;
+}
+
+void test_backends()
+{
+    printf("=== Testing the extended API with another backend ===\n");
+
+    int items[] = {1, 2, 3};
+    void *item;
+    bool called = false;
+    assert(registerBackend(&stub_backend));
+    assert(selectBackend("stub"));
+    initQueue();
+
+    // Calls that only a list queue can serve fail instead of using main_q behind the backend's back
+    assert(defaultQueue() == NULL);
+    assert(!initSpill("/tmp", sizeof(int), 4));
+    assert(!initFairness(2));
+    assert(!enqueueSized(&items[0], 100));
+    assert(!enqueueAfter(&items[0], &(struct timespec){0, 1000000}));
+    assert(!dequeueAsync(async_never, &called));
+    assert(dequeueBatch((void **)&item, 0, 1, NULL) == 0);
+    assert(size() == 0);
+
+    // Flows and staging are only hints, the items still reach the backend
+    enqueueFlow(&items[1], 1);
+    enqueueBuffered(&items[2]);
+    flushEnqueue();
+    assert(size() == 2);
+    assert(!peek(&item));
+    assert(snapshot((void **)&item, 1) == 0);
+    assert(tryDequeue(&item) && item == &items[2]);
+    assert(tryDequeue(&item) && item == &items[1]);
+    assert(!called);
+
+    destroyQueue();
+    assert(selectBackend("list"));
+
+    printf("extended API with another backend test passed.\n");
+}
+
 int main()
 {
     // test_destroyQueue();
@@ -538,6 +1666,23 @@ int main()
     test_enqueue_dequeue_with_sleep();
     test_edge_cases();
     test_mixed_operations();
+    test_spill();
+    test_dequeueAny();
+    test_pool();
+    test_peek_snapshot();
+    test_fairness();
+    test_dequeueAsync();
+    test_combining();
+    test_memory();
+    test_generic();
+    test_dequeueBatch();
+    test_enqueueBuffered();
+    test_recording();
+    test_enqueueAfter();
+    test_topic();
+    test_wake_policy();
+    test_exportStats();
+    test_backends();
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <threads.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include "topic.h"
+
+#define TOPIC_SEG_ITEMS 256 // items per log segment, a segment is freed once every cursor has left it
+
+typedef struct topic_seg
+{
+    uint64_t first; // sequence number of items[0]
+    size_t refs; // cursors currently in this segment, guarded by the topic's mtx
+    struct topic_seg* next;
+    void* items[TOPIC_SEG_ITEMS];
+} topic_seg;
+
+struct topic
+{
+    mtx_t mtx; // guards the segment list, the refs and the sleepers
+    cnd_t cnd; // subscribers blocked in topic_read, woken by one broadcast per publish
+    size_t sleepers;
+    topic_seg* head; // oldest segment still alive
+    topic_seg* tail; // segment being appended to
+    atomic_uint_fast64_t published; // items published so far, the sequence number of the next one
+    size_t nsegs;
+    void (*release)(void*); // called on each item once every subscriber is past it, may be NULL
+};
+
+struct topic_sub
+{
+    topic_t* t;
+    topic_seg* seg; // segment holding the next item to read, the cursor keeps a ref on it
+    uint64_t next; // sequence number of the next item to read
+};
+
+topic_seg* topic_new_seg(uint64_t first)
+{
+    // Allocate an empty segment starting at the given sequence number
+    topic_seg* seg = malloc(sizeof(topic_seg));
+    seg->first = first;
+    seg->refs = 0;
+    seg->next = NULL;
+    return seg;
+}
+
+void topic_free_seg(topic_t* t, topic_seg* seg, uint64_t end)
+{
+    // Release the items of a segment up to sequence number end and free it
+    if(t->release != NULL)
+    {
+        for(uint64_t i = seg->first; i < end && i < seg->first + TOPIC_SEG_ITEMS; i++)
+        {
+            t->release(seg->items[i - seg->first]);
+        }
+    }
+    free(seg);
+}
+
+void topic_reclaim(topic_t* t)
+{
+    // Free the segments at the front that no cursor is in anymore; cursors only move forward and new ones
+    // start at the tail, so nobody can come back to them. The caller holds the topic's mtx
+    topic_seg* seg;
+    while(t->head != t->tail && t->head->refs == 0)
+    {
+        seg = t->head;
+        t->head = seg->next;
+        t->nsegs--;
+        topic_free_seg(t, seg, seg->first + TOPIC_SEG_ITEMS);
+    }
+}
+
+topic_t* topic_create(void (*release)(void*))
+{
+    // Create a topic: every item published is seen by every subscriber, stored once in a shared segmented log.
+    // release (NULL for none) is called on an item once all subscribers have read past it, or at topic_destroy
+    topic_t* t = malloc(sizeof(topic_t));
+    mtx_init(&t->mtx, mtx_plain);
+    cnd_init(&t->cnd);
+    t->sleepers = 0;
+    t->head = t->tail = topic_new_seg(0);
+    t->published = 0;
+    t->nsegs = 1;
+    t->release = release;
+    return t;
+}
+
+void topic_destroy(topic_t* t)
+{
+    // Free the log, releasing the items still in it. Every subscriber must have unsubscribed
+    topic_seg* seg;
+    while(t->head != NULL)
+    {
+        seg = t->head;
+        t->head = seg->next;
+        topic_free_seg(t, seg, t->published);
+    }
+    cnd_destroy(&t->cnd);
+    mtx_destroy(&t->mtx);
+    free(t);
+}
+
+void topic_publish(topic_t* t, void* data)
+{
+    // Append the item to the log, O(1) no matter how many subscribers there are; sleeping readers get one broadcast
+    uint64_t seq;
+    mtx_lock(&t->mtx);
+    seq = t->published;
+    if(seq - t->tail->first == TOPIC_SEG_ITEMS)
+    {
+        t->tail->next = topic_new_seg(seq);
+        t->tail = t->tail->next;
+        t->nsegs++;
+        //with nobody reading the old tail, it can go right away
+        topic_reclaim(t);
+    }
+    t->tail->items[seq - t->tail->first] = data;
+    //the slot is written before the new count is visible to lock-free readers
+    atomic_store_explicit(&t->published, seq + 1, memory_order_release);
+    if(t->sleepers > 0)
+    {
+        cnd_broadcast(&t->cnd);
+    }
+    mtx_unlock(&t->mtx);
+}
+
+topic_sub_t* topic_subscribe(topic_t* t)
+{
+    // Add a subscriber whose cursor starts at the next item to be published
+    topic_sub_t* s = malloc(sizeof(topic_sub_t));
+    s->t = t;
+    mtx_lock(&t->mtx);
+    s->next = t->published;
+    s->seg = t->tail;
+    s->seg->refs++;
+    mtx_unlock(&t->mtx);
+    return s;
+}
+
+void topic_unsubscribe(topic_sub_t* s)
+{
+    // Drop the subscriber's cursor, the segments only it was holding are freed
+    topic_t* t = s->t;
+    mtx_lock(&t->mtx);
+    s->seg->refs--;
+    topic_reclaim(t);
+    mtx_unlock(&t->mtx);
+    free(s);
+}
+
+bool topic_try_read(topic_sub_t* s, void** point)
+{
+    // Read the subscriber's next item without blocking, false if it has read everything published.
+    // Within a segment this takes no lock, the cursor's ref keeps the segment alive. One thread per subscriber
+    topic_t* t = s->t;
+    uint64_t published = atomic_load_explicit(&t->published, memory_order_acquire);
+    if(s->next == published)
+    {
+        return false;
+    }
+    if(s->next - s->seg->first == TOPIC_SEG_ITEMS)
+    {
+        //the cursor leaves its segment, which may have been the last one holding it
+        mtx_lock(&t->mtx);
+        s->seg->refs--;
+        s->seg = s->seg->next;
+        s->seg->refs++;
+        topic_reclaim(t);
+        mtx_unlock(&t->mtx);
+    }
+    *point = s->seg->items[s->next - s->seg->first];
+    s->next++;
+    return true;
+}
+
+void* topic_read(topic_sub_t* s)
+{
+    // Read the subscriber's next item, sleeping until one is published if it is caught up
+    topic_t* t = s->t;
+    void* data;
+    if(topic_try_read(s, &data))
+    {
+        return data;
+    }
+    mtx_lock(&t->mtx);
+    while(s->next == t->published)
+    {
+        t->sleepers++;
+        cnd_wait(&t->cnd, &t->mtx);
+        t->sleepers--;
+    }
+    mtx_unlock(&t->mtx);
+    topic_try_read(s, &data);
+    return data;
+}
+
+size_t topic_backlog(topic_sub_t* s)
+{
+    // Return how many published items the subscriber has not read yet
+    return (size_t) (s->t->published - s->next);
+}
+
+size_t topic_segments(topic_t* t)
+{
+    // Return the number of log segments alive, a measure of the memory held for the slowest subscriber
+    size_t n;
+    mtx_lock(&t->mtx);
+    n = t->nsegs;
+    mtx_unlock(&t->mtx);
+    return n;
+}
@@ -0,0 +1,16 @@
+#ifndef TOPIC_H
+#define TOPIC_H
+#include <stddef.h>
+#include <stdbool.h>
+typedef struct topic topic_t;
+typedef struct topic_sub topic_sub_t;
+topic_t* topic_create(void (*)(void*));
+void topic_destroy(topic_t*);
+void topic_publish(topic_t*, void*);
+topic_sub_t* topic_subscribe(topic_t*);
+void topic_unsubscribe(topic_sub_t*);
+void* topic_read(topic_sub_t*);
+bool topic_try_read(topic_sub_t*, void**);
+size_t topic_backlog(topic_sub_t*);
+size_t topic_segments(topic_t*);
+#endif